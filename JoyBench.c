@@ -0,0 +1,479 @@
+/*
+ *  Joystick driver for MicroDigital Mico
+ *  Copyright (C) 2002 Chris Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+   JoyBench - replays recorded axis timings through the module's processing
+   stages (MicoJoyPrc.c), reporting the throughput of each stage and the
+   error in the resulting joystick positions. It doesn't need a gameport,
+   so it can be run on any machine.
+*/
+
+/* ANSI headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "MicoJoyPrc.h"
+
+
+#define NUM_AXES 4 /* Ax, Ay, Bx, By as in a trace line */
+
+#define MAX_LINE 256
+
+/*
+   Default calibration, similar to that found by *JoystickReInit for a
+   typical analogue stick
+*/
+#define DEFAULT_MIN     0
+#define DEFAULT_CTR     800
+#define DEFAULT_MAX     1600
+#define DEFAULT_CTRZONE 24
+#define DEFAULT_ENDZONE 0
+#define DEFAULT_SMOOTH  16
+
+/*
+   Largest range of 16-bit positions accepted from a centred stick that
+   jitters by the smoothing range (a quarter of the full scale)
+*/
+#define MAX_CENTRE_RANGE 0x4000
+
+typedef struct {
+  unsigned int raw[NUM_AXES]; /* timings read (UINT_MAX if none) */
+  unsigned int ref[NUM_AXES]; /* true timings, if known (else UINT_MAX) */
+} Poll;
+
+static unsigned int calib_min = DEFAULT_MIN, calib_ctr = DEFAULT_CTR, calib_max = DEFAULT_MAX;
+static unsigned int calib_ctrzone = DEFAULT_CTRZONE, calib_endzone = DEFAULT_ENDZONE, calib_smooth = DEFAULT_SMOOTH;
+static int filter = FILTER_BANDED;
+
+static const char usage[] = "Usage: JoyBench [-calib <min> <ctr> <max> <ctrzone> <endzone> <smooth>] [-filter <type>] [-repeat <n>] [-synth <polls>] [<trace file>]\n";
+
+/* ----------------------------------------------------------------------- */
+/*                       Function prototypes                               */
+
+static Poll *load_trace(const char *file_name, int *num_polls);
+static Poll *synth_trace(int num_polls);
+static int parse_timing(const char *word, unsigned int *timing);
+static void run_smoothing(const Poll *trace, int num_polls, unsigned int *out);
+static void report_rate(const char *stage, unsigned long ops, clock_t start, clock_t end);
+static unsigned int centre_range(const AxisCoeffs *coeffs, int axis);
+static unsigned int rand_next(void);
+
+/* ----------------------------------------------------------------------- */
+/*                         Public functions                                */
+
+int main(int argc, char *argv[])
+{
+  const char *file_name = NULL;
+  int repeat = 100, synth = 0, num_polls, arg, i;
+  Poll *trace;
+  unsigned int *smoothed;
+  AxisCoeffs coeffs;
+  clock_t start;
+
+  for(arg = 1; arg < argc; arg++) {
+    if(strcmp(argv[arg], "-calib") == 0 && arg + 6 < argc) {
+      calib_min = (unsigned int)strtoul(argv[++arg], NULL, 0);
+      calib_ctr = (unsigned int)strtoul(argv[++arg], NULL, 0);
+      calib_max = (unsigned int)strtoul(argv[++arg], NULL, 0);
+      calib_ctrzone = (unsigned int)strtoul(argv[++arg], NULL, 0);
+      calib_endzone = (unsigned int)strtoul(argv[++arg], NULL, 0);
+      calib_smooth = (unsigned int)strtoul(argv[++arg], NULL, 0);
+      if(calib_min >= calib_max) {
+        fprintf(stderr, "Calibration min %u must be less than max %u\n", calib_min, calib_max);
+        return EXIT_FAILURE;
+      }
+    } else if(strcmp(argv[arg], "-filter") == 0 && arg + 1 < argc) {
+      filter = find_filter(argv[++arg]);
+      if(filter < 0) {
+        fprintf(stderr, "Unknown filter '%s'\n", argv[arg]);
+        return EXIT_FAILURE;
+      }
+    } else if(strcmp(argv[arg], "-repeat") == 0 && arg + 1 < argc) {
+      repeat = atoi(argv[++arg]);
+    } else if(strcmp(argv[arg], "-synth") == 0 && arg + 1 < argc) {
+      synth = atoi(argv[++arg]);
+    } else if(argv[arg][0] != '-' && file_name == NULL) {
+      file_name = argv[arg];
+    } else {
+      fputs(usage, stderr);
+      return EXIT_FAILURE;
+    }
+  }
+  if(repeat < 1)
+    repeat = 1;
+
+  if(file_name != NULL)
+    trace = load_trace(file_name, &num_polls);
+  else {
+    if(synth < 1)
+      synth = 10000;
+    num_polls = synth;
+    trace = synth_trace(num_polls);
+  }
+  if(trace == NULL)
+    return EXIT_FAILURE;
+  if(num_polls == 0) {
+    fprintf(stderr, "No polls in trace\n");
+    return EXIT_FAILURE;
+  }
+
+  smoothed = malloc(sizeof(*smoothed) * NUM_AXES * num_polls);
+  if(smoothed == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("%d polls, calibration min %u ctr %u max %u ctrzone %u endzone %u smooth %u filter %s\n\n",
+         num_polls, calib_min, calib_ctr, calib_max, calib_ctrzone, calib_endzone, calib_smooth, filter_name(filter));
+
+  /*
+     Time each stage separately, repeating the whole trace so that the
+     measurement is long compared with the resolution of clock()
+  */
+  printf("Stage           Operations  Time (s)      Ops/s\n");
+  printf("--------------- ---------- --------- ----------\n");
+
+  start = clock();
+  for(i = 0; i < repeat; i++)
+    run_smoothing(trace, num_polls, smoothed);
+  report_rate("Smoothing", (unsigned long)repeat * num_polls * NUM_AXES, start, clock());
+
+  start = clock();
+  for(i = 0; i < repeat * num_polls; i++)
+    calc_coefficients(&coeffs, calib_min, calib_ctr + (i & 1), calib_max, calib_ctrzone, calib_endzone);
+  report_rate("Coefficients", (unsigned long)repeat * num_polls, start, clock());
+  calc_coefficients(&coeffs, calib_min, calib_ctr, calib_max, calib_ctrzone, calib_endzone);
+
+  {
+    volatile unsigned int sink = 0; /* stop the conversions being optimised away */
+    int p;
+
+    start = clock();
+    for(i = 0; i < repeat; i++) {
+      for(p = 0; p < num_polls; p++) {
+        const unsigned int *out = &smoothed[p * NUM_AXES];
+        sink = convert_8bit(&coeffs, &coeffs, out[0], out[1]);
+        sink = convert_8bit(&coeffs, &coeffs, out[2], out[3]);
+      } /* next p */
+    }
+    report_rate("Convert 8-bit", (unsigned long)repeat * num_polls * 2, start, clock());
+
+    start = clock();
+    for(i = 0; i < repeat; i++) {
+      for(p = 0; p < num_polls; p++) {
+        const unsigned int *out = &smoothed[p * NUM_AXES];
+        sink = convert_16bit(&coeffs, &coeffs, out[0], out[1]);
+        sink = convert_16bit(&coeffs, &coeffs, out[2], out[3]);
+      } /* next p */
+    }
+    report_rate("Convert 16-bit", (unsigned long)repeat * num_polls * 2, start, clock());
+
+    if(select_conversion(&coeffs, &coeffs) == CONVERT_NOCTRZONE) {
+      /* The module would use the routines without a centre dead zone */
+      start = clock();
+      for(i = 0; i < repeat; i++) {
+        for(p = 0; p < num_polls; p++) {
+          const unsigned int *out = &smoothed[p * NUM_AXES];
+          sink = convert_8bit_noctrzone(&coeffs, &coeffs, out[0], out[1]);
+          sink = convert_8bit_noctrzone(&coeffs, &coeffs, out[2], out[3]);
+        } /* next p */
+      }
+      report_rate("No ctrzone 8", (unsigned long)repeat * num_polls * 2, start, clock());
+
+      start = clock();
+      for(i = 0; i < repeat; i++) {
+        for(p = 0; p < num_polls; p++) {
+          const unsigned int *out = &smoothed[p * NUM_AXES];
+          sink = convert_16bit_noctrzone(&coeffs, &coeffs, out[0], out[1]);
+          sink = convert_16bit_noctrzone(&coeffs, &coeffs, out[2], out[3]);
+        } /* next p */
+      }
+      report_rate("No ctrzone 16", (unsigned long)repeat * num_polls * 2, start, clock());
+    }
+    (void)sink;
+  }
+
+  /*
+     Compare the 16-bit output with that for the true timings (or if those
+     aren't known, with the unsmoothed timings)
+  */
+  printf("\nAxis  Not read    Compared Mean error  Max error\n");
+  printf("---- --------- ----------- ---------- ----------\n");
+  {
+    static const char *const axis_names[NUM_AXES] = { "Ax", "Ay", "Bx", "By" };
+    int axis;
+
+    for(axis = 0; axis < NUM_AXES; axis++) {
+      unsigned long not_read = 0, compared = 0;
+      double total = 0;
+      unsigned int max_error = 0;
+      int p;
+
+      for(p = 0; p < num_polls; p++) {
+        unsigned int truth = trace[p].ref[axis], out, expected, error;
+        if(trace[p].raw[axis] == UINT_MAX)
+          not_read++;
+        if(truth == UINT_MAX)
+          truth = trace[p].raw[axis];
+        if(truth == UINT_MAX)
+          continue; /* nothing to compare with */
+
+        /* (both axes of a stick are converted together, so convert as X) */
+        out = POS16_X(convert_16bit(&coeffs, &coeffs, smoothed[p * NUM_AXES + axis], calib_ctr));
+        expected = POS16_X(convert_16bit(&coeffs, &coeffs, truth, calib_ctr));
+        error = out > expected ? out - expected : expected - out;
+        if(error > max_error)
+          max_error = error;
+        total += error;
+        compared++;
+      } /* next p */
+      printf("%-4s %9lu %11lu %10.1f %10u\n", axis_names[axis], not_read, compared,
+             compared ? total / compared : 0.0, max_error);
+    } /* next axis */
+  }
+
+  /*
+     Check that a stick at its centre gives a small range of positions,
+     as *JoystickBench would show for it
+  */
+  {
+    unsigned int x_range = centre_range(&coeffs, 0), y_range = centre_range(&coeffs, 1);
+
+    printf("\nCentre range X %u Y %u\n", x_range, y_range);
+    if(x_range >= MAX_CENTRE_RANGE || y_range >= MAX_CENTRE_RANGE) {
+      fprintf(stderr, "Range of positions at centre is too large\n");
+      free(smoothed);
+      free(trace);
+      return EXIT_FAILURE;
+    }
+  }
+
+  free(smoothed);
+  free(trace);
+  return EXIT_SUCCESS;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                         Private functions                               */
+
+static Poll *load_trace(const char *file_name, int *num_polls)
+{
+  /*
+     Read a trace of raw axis timings, one poll per line:
+       <Ax> <Ay> <Bx> <By> [<true Ax> <true Ay> <true Bx> <true By>]
+     in IOC timer ticks, with '-' (or 4294967295) for an axis not read.
+     Lines beginning with '#' are ignored.
+  */
+  FILE *f = fopen(file_name, "r");
+  char line[MAX_LINE];
+  Poll *trace = NULL;
+  int count = 0, size = 0, line_num = 0;
+
+  if(f == NULL) {
+    fprintf(stderr, "Can't open trace file %s\n", file_name);
+    return NULL;
+  }
+
+  while(fgets(line, sizeof(line), f) != NULL) {
+    char *word;
+    int n = 0;
+    unsigned int values[NUM_AXES * 2];
+
+    line_num++;
+    if(line[0] == '#')
+      continue; /* comment */
+
+    for(word = strtok(line, " \t\r\n"); word != NULL && n < NUM_AXES * 2; word = strtok(NULL, " \t\r\n")) {
+      if(!parse_timing(word, &values[n++])) {
+        fprintf(stderr, "Bad timing '%s' at line %d of %s\n", word, line_num, file_name);
+        fclose(f);
+        free(trace);
+        return NULL;
+      }
+    }
+    if(n == 0)
+      continue; /* blank line */
+    if(n != NUM_AXES && n != NUM_AXES * 2) {
+      fprintf(stderr, "Expected %d or %d timings at line %d of %s\n", NUM_AXES, NUM_AXES * 2, line_num, file_name);
+      fclose(f);
+      free(trace);
+      return NULL;
+    }
+
+    if(count >= size) {
+      Poll *bigger;
+      size = size ? size * 2 : 1024;
+      bigger = realloc(trace, sizeof(*trace) * size);
+      if(bigger == NULL) {
+        fprintf(stderr, "Not enough memory\n");
+        fclose(f);
+        free(trace);
+        return NULL;
+      }
+      trace = bigger;
+    }
+    {
+      int axis;
+      for(axis = 0; axis < NUM_AXES; axis++) {
+        trace[count].raw[axis] = values[axis];
+        trace[count].ref[axis] = (n == NUM_AXES * 2) ? values[NUM_AXES + axis] : UINT_MAX;
+      }
+    }
+    count++;
+  }
+  fclose(f);
+
+  if(trace == NULL)
+    trace = malloc(sizeof(*trace)); /* (empty trace) */
+  *num_polls = count;
+  return trace;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static Poll *synth_trace(int num_polls)
+{
+  /*
+     Make up a trace of stick A sweeping slowly back and forth, and
+     stick B not connected. Timings have random jitter of up to the
+     smoothing range, and occasional lost reads.
+  */
+  Poll *trace = malloc(sizeof(*trace) * num_polls);
+  unsigned int span = calib_max - calib_min;
+  int p;
+
+  if(trace == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    return NULL;
+  }
+
+  for(p = 0; p < num_polls; p++) {
+    int axis;
+    /* triangle waves, with x and y at different rates */
+    unsigned int phase_x = (p * 7) % (2 * span), phase_y = (p * 3) % (2 * span);
+
+    trace[p].ref[0] = calib_min + (phase_x < span ? phase_x : 2 * span - phase_x);
+    trace[p].ref[1] = calib_min + (phase_y < span ? phase_y : 2 * span - phase_y);
+    trace[p].ref[2] = UINT_MAX;
+    trace[p].ref[3] = UINT_MAX;
+
+    for(axis = 0; axis < NUM_AXES; axis++) {
+      unsigned int ref = trace[p].ref[axis];
+      if(ref == UINT_MAX || rand_next() % 100 == 0) {
+        trace[p].raw[axis] = UINT_MAX; /* timed out or lost */
+      } else {
+        unsigned int jitter = calib_smooth ? rand_next() % (2 * calib_smooth + 1) : 0;
+        trace[p].raw[axis] = ref + jitter >= calib_smooth ? ref + jitter - calib_smooth : 0;
+      }
+    } /* next axis */
+  } /* next p */
+  return trace;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int parse_timing(const char *word, unsigned int *timing)
+{
+  char *end;
+  if(strcmp(word, "-") == 0) {
+    *timing = UINT_MAX;
+    return 1; /* success */
+  }
+  *timing = (unsigned int)strtoul(word, &end, 0);
+  return *end == '\0';
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void run_smoothing(const Poll *trace, int num_polls, unsigned int *out)
+{
+  /*
+     Pass each poll's timings through the smoothing stage, as
+     store_timings() does in the module (an axis not read keeps its value)
+  */
+  unsigned int axis_value[NUM_AXES];
+  FilterState state[NUM_AXES];
+  int p, axis;
+
+  for(axis = 0; axis < NUM_AXES; axis++) {
+    axis_value[axis] = calib_ctr;
+    reset_filter(&state[axis], calib_ctr);
+  }
+
+  for(p = 0; p < num_polls; p++) {
+    for(axis = 0; axis < NUM_AXES; axis++) {
+      unsigned int raw = trace[p].raw[axis];
+      if(raw != UINT_MAX) {
+        if(calib_smooth > 0 || filter == FILTER_MEDIAN)
+          axis_value[axis] = filter_value(filter, &state[axis], axis_value[axis], raw, calib_smooth);
+        else
+          axis_value[axis] = raw;
+      }
+      *out++ = axis_value[axis];
+    } /* next axis */
+  } /* next p */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void report_rate(const char *stage, unsigned long ops, clock_t start, clock_t end)
+{
+  double seconds = (double)(end - start) / CLOCKS_PER_SEC;
+  if(seconds > 0)
+    printf("%-15s %10lu %9.3f %10.0f\n", stage, ops, seconds, ops / seconds);
+  else
+    printf("%-15s %10lu %9.3f (too fast - use a larger -repeat)\n", stage, ops, seconds);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int centre_range(const AxisCoeffs *coeffs, int axis)
+{
+  /*
+     Find the range of 16-bit positions given by one axis (0 for X, 1 for
+     Y) when its timings are within the smoothing range of the centre,
+     unpacking them as run_bench does in the module
+  */
+  unsigned int time = calib_ctr >= calib_smooth ? calib_ctr - calib_smooth : 0;
+  unsigned int pos_min = UINT_MAX, pos_max = 0;
+
+  for(; time <= calib_ctr + calib_smooth; time++) {
+    unsigned int pos16 = convert_16bit(coeffs, coeffs, time, time);
+    unsigned int pos = axis ? POS16_Y(pos16) : POS16_X(pos16);
+    if(pos < pos_min)
+      pos_min = pos;
+    if(pos > pos_max)
+      pos_max = pos;
+  } /* next time */
+
+  return pos_max - pos_min;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int rand_next(void)
+{
+  /* Simple generator, so that synthetic traces are the same everywhere */
+  static unsigned long seed = 12345;
+  seed = (seed * 1103515245ul + 12345ul) & 0x7fffffff;
+  return (unsigned int)(seed >> 8);
+}
@@ -34,6 +34,8 @@
 /* CMHG header */
 #include "MicoJoyHdr.h"
 #include "MicoJoyErr.h"
+#include "MicoJoySmp.h"
+#include "MicoJoyPrc.h"
 
 
 /*
@@ -59,27 +61,167 @@ static const char *log_name = "Joystick";
 */
 #define MAX_AXIS_WAIT_TIME 2000 /* default */
 
+/*
+   Margin (as a fraction of the timing) beyond the largest calibrated max
+   and end zone of the axes being read, before giving up on them
+   (*JoystickConfig -autotimeout)
+*/
+#define AUTO_TIMEOUT_SHIFT 3 /* 1/8 */
+
+/*
+   An axis still timing at that deadline is only taken to be at its max if
+   its previous timing was within this fraction of the range from centre
+   to max (otherwise it has timed out)
+*/
+#define AUTO_TIMEOUT_NEAR_SHIFT 2 /* 1/4 */
+
+/*
+   Most polls per read of the slowest axes (*JoystickConfig -stagger), and
+   how far (as a fraction of the timing) an axis' calibrated max and end
+   zone may lie beyond those of the fastest axis for it to be read on every
+   poll regardless
+*/
+#define MAX_STAGGER 8
+#define STAGGER_TAIL_SHIFT 2 /* 1/4 */
+
+/*
+   Most immediate re-reads of axes whose values were lost to interrupt
+   latency, within one read (*JoystickConfig -retry). Re-reads are
+   triggered without the 1cs pause that calibration allows between reads,
+   so their timings may differ slightly from those of a first read.
+*/
+#define MAX_RETRIES 4
+
+/*
+   Interval (in s/2) between gameport samples when axes are timed from
+   IOC timer 1 interrupts rather than by busy-waiting (*JoystickConfig -irqtiming)
+    - if too small then most of the CPU time is spent entering and leaving
+      the interrupt handler (the CMHG veneer is not cheap)
+    - if too long then axis timings are coarse
+*/
+#define IRQ_SAMPLE_PERIOD 100
+
+/*
+   Extra delay (in s/2) allowed between timer 1 samples, on top of the
+   configured tolerance. Timings under interrupt are only accurate to half the
+   sampling period anyway, so a sample that is late by up to that much more
+   is still kept.
+*/
+#define IRQ_SAMPLE_SLACK (IRQ_SAMPLE_PERIOD/2)
+
 /*
    Joystick polling frequency (in cs), must be at least 2!
 */
 #define POLL_FREQUENCY 7 /* default */
 
+/*
+   Shortest interval (in cs) between polls in adaptive mode, which is
+   also the period of the ticker event in that mode
+*/
+#define MIN_POLL_INTERVAL 2
+
+/*
+   Longest time (in cs) beyond a poll to which Joystick_Read may
+   extrapolate stick positions (*JoystickConfig -predict)
+*/
+#define MAX_PREDICT_TIME 20
+
+/*
+   Time (in seconds) for which *JoystickBench reads the joysticks at each
+   rate, by default and at most
+*/
+#define BENCH_DEFAULT_TIME 5
+#define BENCH_MAX_TIME 60
+
+/*
+   Fractional bits of axis velocities (timing units per IOC timer tick)
+*/
+#define VELOCITY_SHIFT 16
+
+/*
+   Fastest axis velocity believed, far beyond any real stick movement
+   (sweeping a typical axis in under 1cs). Reads close together can
+   otherwise give wild estimates, and the bound keeps the arithmetic of
+   extrapolation within 32 bits.
+*/
+#define MAX_VELOCITY (1 << (VELOCITY_SHIFT-4)) /* 1/16 */
+
+/*
+   Polls between reads of disconnected axes, to find joysticks that have
+   been plugged in (*JoystickConfig -hotplug)
+*/
+#define HOTPLUG_INTERVAL 16
+
+/*
+   Jitter (in s/2) assumed for an axis found by a hotplug probe that has
+   never been calibrated, until self-calibration has seen more of it
+*/
+#define HOTPLUG_JITTER 8
+
 /*
    Interval (in cs) between calling the Joystick_Read usage monitor
 */
 #define MONITOR_INTERVAL 1000
 
 /*
-   Number of joysticks supported - for readability
-   (No guarantees that you can change this and still have it work!)
+   Maximum number of clients registered using Joystick_Register
+*/
+#define MAX_CLIENTS 8
+
+/*
+   Client handle given by a registered program in R0 of the reading SWIs
+   (0 for a program that never registered)
+*/
+#define READ_HANDLE_SHIFT 16
+#define READ_HANDLE_MASK  (0xffu << READ_HANDLE_SHIFT)
+
+/*
+   Number of joysticks on each gameport, and the most gameports supported
+   (the fire buttons of all joysticks are packed into one word, 8 bits per
+   joystick, so there can be no more than 4 joysticks)
 */
-#define NUM_STICKS 2
+#define STICKS_PER_PORT 2
+#define MAX_PORTS SAMPLE_PORTS /* (limited by sample_axes) */
+#define MAX_STICKS (MAX_PORTS * STICKS_PER_PORT)
 
 /*
-   Number of tests runs to do - for get_av_stick_pos() and reinit_joysticks()
+   Number of tests runs to do - for each phase of a calibration job
 */
 #define NUM_TEST_RUNS 32
 
+/*
+   Maximum number of reads to wait for sticks to settle before averaging
+*/
+#define CALIB_SETTLE_RUNS 8
+
+/*
+   Number of test runs for each phase if outliers are rejected
+   (*JoystickConfig -robustcalib), and how far from the median a value may
+   be (as a multiple of the root mean square deviation) before it is
+   rejected as an outlier
+*/
+#define ROBUST_TEST_RUNS 16
+#define ROBUST_REJECT_RANGE 3
+#define ROBUST_MIN_DEVIATION 2 /* values this close to the median are always kept */
+#define ROBUST_MAX_DEVIATION 4096 /* limit on deviations summed (so the total can't overflow) */
+#define ROBUST_FRAC_SHIFT 4 /* fractional bits of mean */
+
+/*
+   Event raised when a stick's position or buttons change (if enabled),
+   with R1 = Joystick_Read to distinguish it from other users' events
+*/
+#define Event_User 9
+
+/*
+   Size (in words) of each stick's entry in the Joystick_ReadAll block
+*/
+#define JOY_READALL_WORDS 3
+
+/*
+   Number of polls recorded for Joystick_ReadHistory (must be a power of 2)
+*/
+#define HISTORY_SIZE 64
+
 /* This comes out really neat in ARM code, honest! */
 #define absdiff(d, x, y) { \
   if(x > y)    \
@@ -110,8 +252,24 @@ static const char *log_name = "Joystick";
 #define PC_JOY_B_B1 (1u << 6)
 #define PC_JOY_B_B2 (1u << 7) /* status packed into single byte */
 
-static volatile unsigned char *game_port_address; /* get address from PnP manager */
-static unsigned int axes_mask = 0; /* axes bits to read - set by reinit_joysticks() */
+#define PORT_AXES (PC_JOY_A_X | PC_JOY_A_Y | PC_JOY_B_X | PC_JOY_B_Y)
+
+/*
+   Gameports found by find_gameports(). Joysticks are numbered across all
+   gameports in order, so joystick n is on gameport n / STICKS_PER_PORT.
+   Axis bits for all gameports are packed into one word, each gameport's
+   PC_JOY_ axis bits shifted by PORT_AXIS_SHIFT times its number (so the
+   axes of joystick n are given by STICK_AXES(n)).
+*/
+
+#define PORT_AXIS_SHIFT 4
+#define STICK_AXES(stick_num) ((PC_JOY_A_X | PC_JOY_A_Y) << ((stick_num) * 2))
+#define ALL_STICKS ((1u << num_sticks) - 1) /* joysticks on all gameports found */
+
+static volatile unsigned char *port_address[MAX_PORTS]; /* get addresses from PnP manager */
+static int num_ports = 0, num_sticks = 0;
+static unsigned int axes_mask = 0; /* axes bits to read - set by calibration */
+static unsigned int calib_valid = 0; /* joysticks with measured or loaded calibration values (bit n for joystick n) */
 
 /*
    Details of IOC chip (used for timing)
@@ -153,6 +311,15 @@ typedef struct _IOC { /* IOC registers (All 8 bits wide) */
   volatile IOC_Timer timer_3;
 } IOC;
 
+#define IOC_IRQ_A_TM0 (1u << 5)
+#define IOC_IRQ_A_TM1 (1u << 6) /* timer bits in IRQ A status/request/mask */
+
+#define TIMER_1_DEVICE 6 /* device number for OS_ClaimDeviceVector */
+
+/* Make the current count of IOC timer 0 appear on its latch, then read it */
+#define read_timer_0(ioc) ((ioc)->timer_0.latch[0] = 0, \
+  (unsigned int)((ioc)->timer_0.low[0] + ((ioc)->timer_0.high[0] << 8)))
+
 /*
    Calibration state - for Joystick_CalibrateTopRight & Joystick_CalibrateBottomLeft
    (both must be called before completion)
@@ -165,12 +332,197 @@ typedef struct _IOC { /* IOC registers (All 8 bits wide) */
 static int calib_status = CALIB_NONE;
 
 /*
-   Current axis time values (possibly smoothed)
+   Calibration job (see calib_step), run either in the foreground or one
+   read per poll in the background (*JoystickConfig -bgcalib)
+*/
+
+#define CALIB_PHASE_IDLE    0
+#define CALIB_PHASE_DETECT  1 /* find connected axes and their jitter */
+#define CALIB_PHASE_SETTLE  2 /* wait for sticks to settle */
+#define CALIB_PHASE_AVERAGE 3 /* find average position and deviation */
+
+#define CALIB_GOAL_REINIT       0 /* *JoystickReInit (stick at centre) */
+#define CALIB_GOAL_TOP_RIGHT    1 /* Joystick_CalibrateTopRight */
+#define CALIB_GOAL_BOTTOM_LEFT  2 /* Joystick_CalibrateBottomLeft */
+
+typedef struct {
+  int phase, goal;
+  unsigned int sticks; /* bit n set for joystick n */
+  unsigned int read_axes; /* axes bits to read */
+  unsigned int reads; /* reads done so far */
+  int runs; /* reads in each test phase */
+  int test; /* countdown of reads in this phase */
+  int go_go_go; /* countdown of reads to wait for sticks to settle */
+  unsigned int new_mask; /* axes that didn't time out */
+  bool old_smooth; /* smoothing setting to restore */
+  bool robust; /* reject outliers (-robustcalib when the job started) */
+  bool started_polling; /* polling was started for this job (-bgcalib) */
+  unsigned int last_x[MAX_STICKS], last_y[MAX_STICKS];
+  unsigned int x_tot[MAX_STICKS], y_tot[MAX_STICKS];
+  unsigned int x_jit_max[MAX_STICKS], x_jit_min[MAX_STICKS], y_jit_max[MAX_STICKS], y_jit_min[MAX_STICKS];
+  unsigned int x_samples[MAX_STICKS][NUM_TEST_RUNS], y_samples[MAX_STICKS][NUM_TEST_RUNS]; /* values (or differences) read in this phase */
+} CalibJob;
+
+static CalibJob calib_job = { CALIB_PHASE_IDLE };
+
+/*
+   Time (in IOC timer ticks) at which the current axis values were read
+*/
+
+static unsigned int axis_time;
+
+/*
+   Axis time values (and the resulting joystick positions) published
+   for Joystick_Read. The poll writes
+   into the spare buffer and then increments snapshot_seq, so that a
+   reader can detect an update part way through copying a snapshot.
+*/
+
+typedef struct {
+  unsigned int x_axis[MAX_STICKS], y_axis[MAX_STICKS];
+  unsigned int x_raw[MAX_STICKS], y_raw[MAX_STICKS]; /* before smoothing (for Joystick_Read 4) */
+  unsigned int pos8[MAX_STICKS], pos16[MAX_STICKS]; /* converted for Joystick_Read 0 and 1 */
+  signed int x_vel[MAX_STICKS], y_vel[MAX_STICKS]; /* for prediction */
+  unsigned int x_time[MAX_STICKS], y_time[MAX_STICKS]; /* when each axis was last read (may be earlier polls, with -stagger) */
+  unsigned int time; /* when the axes were read (IOC timer ticks) */
+  unsigned int samples; /* count of snapshots published */
+} Snapshot;
+
+static Snapshot snapshot[2];
+static volatile unsigned int snapshot_seq = 0; /* bit 0 gives current buffer */
+
+/*
+   State block in the RMA, whose address is given to clients by
+   Joystick_StateBlock so that they can read the joysticks without calling
+   a SWI. It is updated each time a snapshot is published, and its sequence
+   number is incremented before and after, so that a reader can detect an
+   update part way through. (layout is part of the SWI interface)
+   Before the block is freed its version is zeroed and its sequence
+   number left odd, so that a late reader never sees a consistent copy.
+*/
+#define STATE_BLOCK_VERSION 2 /* (version 1 gave edges since the previous update) */
+
+#define PRESS_COUNT_SHIFT 16 /* bits of each button's count in press and release counters */
+
+typedef struct {
+  unsigned int pos8; /* as Joystick_Read 0 (with fire buttons) */
+  unsigned int pos16; /* as Joystick_Read 1 */
+  unsigned int buttons; /* fire buttons */
+  unsigned int presses, releases; /* counts of each button pressed or released (button 0 in bits 0-15, button 1 in bits 16-31) */
+} StateStick;
+
+typedef struct {
+  unsigned int version; /* STATE_BLOCK_VERSION */
+  unsigned int size; /* of block, in bytes */
+  unsigned int seq; /* odd whilst being updated */
+  unsigned int num_sticks;
+  unsigned int samples; /* as Joystick_Read 2 */
+  unsigned int time; /* monotonic time of update (cs) */
+  StateStick stick[MAX_STICKS];
+} StateBlock;
+
+static volatile StateBlock *state_block = NULL; /* (claimed when first asked for) */
+
+/*
+   Fire buttons sampled by pollstick_handler (bits 8n to 8n+7 for
+   joystick n), latches of the edges seen since each stick was
+   last read by Joystick_Read 3, and running counts of the edges of each
+   button for state_block (laid out as StateStick.presses)
+*/
+static volatile unsigned int button_state = 0; /* bits set reflect buttons pushed */
+static volatile unsigned int button_pressed = 0, button_released = 0;
+static volatile unsigned int press_count[MAX_STICKS], release_count[MAX_STICKS];
+
+/*
+   Record of recent polls, for Joystick_ReadHistory
+   (layout is part of the SWI interface)
+*/
+
+typedef struct {
+  unsigned int time; /* monotonic time of poll (cs) */
+  unsigned int raw_x[MAX_STICKS], raw_y[MAX_STICKS]; /* timings read (UINT_MAX if none) */
+  unsigned int x_axis[MAX_STICKS], y_axis[MAX_STICKS]; /* after smoothing */
+  unsigned int buttons; /* laid out as button_state */
+} HistoryRecord;
+
+static HistoryRecord history[HISTORY_SIZE];
+static unsigned int history_count = 0; /* records ever written (next is at history_count % HISTORY_SIZE) */
+
+/*
+   Counters of the driver's activity, kept for *JoystickStats and
+   Joystick_ReadStats (layout is part of the SWI interface).
+   Times are in IOC timer ticks (0.5s). Only polls started by the ticker
+   are counted, not reads for calibration.
+   If built with STATS_HISTOGRAMS, times are also counted in histograms
+   whose bucket n holds times from 2^n to 2^(n+1)-1 ticks (bucket 0 also
+   holds 0, and the last bucket also holds anything longer).
 */
 
-static unsigned int x_axis[NUM_STICKS], y_axis[NUM_STICKS];
+#ifdef STATS_HISTOGRAMS
+#define STATS_BUCKETS 24 /* (the last starts at about 4 seconds) */
+#endif
+
+typedef struct {
+  unsigned int polls; /* CallBacks added to read the sticks */
+  unsigned int skipped; /* ticks on which the previous read was still in progress */
+  unsigned int reads; /* reads completed */
+  unsigned int lost[MAX_STICKS]; /* reads on which an axis value was lost (late samples) */
+  unsigned int timeouts[MAX_STICKS * 2]; /* reads on which each X and Y axis timed out */
+  unsigned int read_min, read_max, read_total; /* time taken by each read */
+  unsigned int delays; /* CallBacks reached */
+  unsigned int delay_min, delay_max, delay_total; /* from ticker to CallBack */
+  unsigned int axis_lost[MAX_STICKS * 2]; /* reads on which each X and Y axis value was lost (not recovered by any re-read) */
+#ifdef STATS_HISTOGRAMS
+  unsigned int delay_hist[STATS_BUCKETS]; /* from ticker to CallBack */
+  unsigned int read_hist[STATS_BUCKETS]; /* time taken by each read */
+  unsigned int interval_hist[STATS_BUCKETS]; /* from the start of one read to the start of the next */
+#endif
+} Stats;
+
+static Stats stats;
+static unsigned int callback_time; /* when pollstick_handler added the CallBack */
+static unsigned int read_start_time; /* when doread_handler started reading */
+#ifdef STATS_HISTOGRAMS
+static unsigned int prev_read_start_time; /* when doread_handler started the previous read */
+static bool prev_read_valid = false; /* was there a previous read since polling started? */
+#endif
+
+/*
+   Results of one run of *JoystickBench (see run_bench). Times are in IOC
+   timer ticks, and positions are as Joystick_Read 1.
+*/
+
+typedef struct {
+  unsigned int interval; /* between the starts of reads (cs), or 0 for back to back */
+  unsigned int reads; /* reads completed */
+  unsigned int read_min, read_max, read_total; /* time taken by each read */
+  unsigned int elapsed; /* length of the run */
+  unsigned int timeouts[MAX_STICKS * 2]; /* reads on which each X and Y axis timed out */
+  unsigned int axis_lost[MAX_STICKS * 2]; /* reads on which each X and Y axis value was lost (not recovered by any re-read) */
+  signed int pos_min[MAX_STICKS * 2], pos_max[MAX_STICKS * 2]; /* range of each smoothed and converted axis */
+} BenchResult;
 
 /*
+   Online calibration state (*JoystickConfig -autocalib), see track_axis
+*/
+
+#define AUTOCAL_WINDOW 1024 /* polls over which to find extremes before narrowing limits */
+#define AUTOCAL_FRAC_SHIFT 4 /* fractional bits of centre estimate */
+#define AUTOCAL_CTR_SHIFT 5 /* centre estimate moves 1/32 of the way to each value */
+
+typedef struct {
+  unsigned int seen_min, seen_max; /* extremes in the current window */
+  unsigned int ctr_est; /* running average of values near centre */
+} AxisTrack;
+
+static unsigned int autocal_polls = 0; /* polls in the current window */
+static unsigned int hotplug_track = 0; /* joysticks found by a hotplug probe, tracked even without -autocalib */
+static unsigned int hotplug_polls = 0; /* polls since the last hotplug probe */
+
+/*
+   State of each joystick axis. The values used on every poll come first,
+   so that they share a cache line.
+
      Values established by calibration
                                                 
     min              ctr_low   ctr  ctr_high             max
@@ -180,43 +532,120 @@ static unsigned int x_axis[NUM_STICKS], y_axis[NUM_STICKS];
       end_deadz            ctr_deadz              end_deadz
 */
 
-static unsigned int x_min[NUM_STICKS], x_max[NUM_STICKS], y_min[NUM_STICKS], y_max[NUM_STICKS];
-static unsigned int x_ctr_deadz[NUM_STICKS], y_ctr_deadz[NUM_STICKS], x_ctr[NUM_STICKS], y_ctr[NUM_STICKS];
-static unsigned int x_end_deadz[NUM_STICKS], y_end_deadz[NUM_STICKS];
-static unsigned int x_smooth[NUM_STICKS], y_smooth[NUM_STICKS];
+typedef struct {
+  unsigned int value; /* current time value (possibly smoothed) */
+  signed int vel; /* average rate of change of value (VELOCITY_SHIFT bits of fraction) */
+  unsigned int time; /* read_start_time when last read */
+  unsigned int raw; /* timing when last read, before smoothing */
+  unsigned int smooth; /* smoothing range */
+  int filter; /* FILTER_BANDED etc */
+  FilterState filter_state; /* filter history (see filter_value) */
+  AxisCoeffs coeffs; /* values used in *actual* conversion to 8-bit / 16-bit position */
+  unsigned int min, ctr, max, ctr_deadz, end_deadz;
+  AxisTrack track;
+} Axis;
+
+typedef struct {
+  Axis x, y;
+  int conversion; /* conversion routines to use for the axis coefficients (CONVERT_CTRZONE etc) */
+  unsigned int event_presses, event_releases; /* press_count and release_count when last compared */
+} Stick;
+
+static Stick stick[MAX_STICKS];
+static Stick bench_saved[MAX_STICKS]; /* axis state to put back after *JoystickBench (too big for the SVC stack) */
+static bool benchmarking = false; /* reads are for *JoystickBench, so not published */
 
 /*
-   Values used in *actual* conversion to 8-bit / 16-bit position:
+   Calibration file (*JoystickSave), holding a record for each gameport
+   address. Loaded at initialisation instead of re-initialising.
 */
 
-#define SCALER_FRAC_SHIFT 14
+#define CALIB_FILE_READ  "Choices:Joystick"
+#define CALIB_FILE_WRITE_DIR "Choices$Write" /* variable giving directory to save in */
+#define CALIB_FILE_LEAF  "Joystick"
+
+#define CALIB_FILE_MAGIC   0x796f4a4d /* "MJoy" */
+#define CALIB_FILE_VERSION 2
+#define CALIB_FILE_MAX_RECORDS 8
 
-static unsigned int x_ctr_low[NUM_STICKS], y_ctr_low[NUM_STICKS], x_ctr_high[NUM_STICKS], y_ctr_high[NUM_STICKS];
-static unsigned int x_low_scaler[NUM_STICKS], x_high_scaler[NUM_STICKS], y_low_scaler[NUM_STICKS], y_high_scaler[NUM_STICKS];
+typedef struct {
+  unsigned int magic, version;
+  unsigned int num_records;
+} CalibFileHeader;
 
+typedef struct {
+  unsigned int min, ctr, max, ctr_deadz, end_deadz, smooth;
+  int filter;
+} AxisRecord;
+
+typedef struct {
+  unsigned int port; /* gameport address */
+  unsigned int axes; /* axes_mask bits for this gameport */
+  AxisRecord x[STICKS_PER_PORT], y[STICKS_PER_PORT];
+} CalibRecord;
 
 /*
    Internal joystick polling state
 */
 
 static bool polling_stick = false, /* attached OS_CallEvery to pollstick_veneer? */
-            swi_in_last_min = false, /* continue polling? (checked periodically) */
+            swi_in_last_min = false, /* read by an unregistered program? (checked periodically) */
             callback_pending = false, /* outstanding CallBack to doread_veneer? */
             callback_free = true; /* may we add another CallBack? (none in progress) */
 
+/*
+   Clients registered using Joystick_Register, which declare the axes they
+   need and how often (polling continues until the last one deregisters)
+*/
+
+typedef struct {
+  bool used;
+  unsigned int axes; /* axes bits wanted (bit 2n for the X axis of joystick n, 2n+1 for Y) */
+  unsigned int interval; /* minimum time between reads wanted (in cs), or 0 for every poll */
+  unsigned int next_time; /* monotonic time at which the axes are next due */
+} Client;
+
+static Client client[MAX_CLIENTS];
+static int num_clients = 0;
+
+/*
+   Interrupt-driven axis timing state (see timer_handler)
+*/
+
+static volatile bool irq_sampling = false; /* timer 1 interrupts enabled to sample gameport? */
+static bool timer_claimed = false, /* attached timer_veneer to timer 1 device vector? */
+            finish_pending = false; /* outstanding CallBack to finish_veneer? */
+static unsigned int irq_mask, irq_lost; /* axes still to read (all gameports), axes with lost values */
+static unsigned int irq_timed_out, irq_attempt; /* axes timed out on earlier attempts, re-reads so far (-retry) */
+static unsigned int irq_start_time, irq_prev_time, irq_max_wait;
+static unsigned int irq_probe; /* disconnected axes being read by a hotplug probe */
+static unsigned int irq_new_x[MAX_STICKS], irq_new_y[MAX_STICKS];
+
 /*
   Global configuration (set using *JoystickConfig)
 */
 
 static unsigned int max_wait = MAX_AXIS_WAIT_TIME, tolerance = MAX_GRANULARITY;
-static bool smooth = true, end_zones = true, ctr_zones = true;
+static bool smooth = true, end_zones = true, ctr_zones = true, irq_timing = false, events = false, bg_calib = false, autocalib = false, auto_timeout = false, hotplug = false, robust_calib = false, warm_start = false;
 static unsigned int poll_freq = POLL_FREQUENCY-1;
+static unsigned int adaptive_ceiling = 0; /* longest poll interval (in cs) in adaptive mode, or 0 */
+static unsigned int predict_time = 0; /* longest extrapolation (in cs) by Joystick_Read, or 0 */
+static unsigned int stagger = 0; /* polls per read of the slowest axes, or 0 to read all axes on every poll */
+static unsigned int stagger_polls = 0; /* polls since the slowest axes were read */
+static unsigned int retries = 0; /* re-reads of lost axes allowed per read */
+
+/*
+  Adaptive polling state (see pollstick_handler)
+*/
+
+static unsigned int poll_interval = MIN_POLL_INTERVAL, /* current interval between polls (in cs) */
+                    poll_countdown = 1; /* ticker events (each 1cs) until next poll */
 
 /*
   Command syntax strings for use with OS_ReadArgs
 */
 
-static const char config_syntax[] = "smooth/S,nosmooth/S,ctrzone/S,noctrzone/S,endzone/S,noendzone/S,tolerance/E/K,timeout/E/K,poll/E/K";
+static const char config_syntax[] = "smooth/S,nosmooth/S,ctrzone/S,noctrzone/S,endzone/S,noendzone/S,tolerance/E/K,timeout/E/K,poll/E/K,irqtiming/S,noirqtiming/S,event/S,noevent/S,adaptive/E/K,noadaptive/S,bgcalib/S,nobgcalib/S,autocalib/S,noautocalib/S,filter/K,predict/E/K,nopredict/S,autotimeout/S,noautotimeout/S,hotplug/S,nohotplug/S,stagger/E/K,nostagger/S,retry/E/K,noretry/S,robustcalib/S,norobustcalib/S,warmstart/S,nowarmstart/S";
 #define CONFIG_SYNTAX_SMOOTH     0
 #define CONFIG_SYNTAX_NOSMOOTH   1
 #define CONFIG_SYNTAX_CTRZONE    2
@@ -226,8 +655,33 @@ static const char config_syntax[] = "smooth/S,nosmooth/S,ctrzone/S,noctrzone/S,e
 #define CONFIG_SYNTAX_TOLERANCE  6
 #define CONFIG_SYNTAX_TIMEOUT    7
 #define CONFIG_SYNTAX_POLL       8
-
-static const char calib_syntax[] = "/E/A,/A,min/E/K,ctr/E/K,max/E/K,ctrzone/E/K,endzone/E/K,smooth/E/K";
+#define CONFIG_SYNTAX_IRQTIMING  9
+#define CONFIG_SYNTAX_NOIRQTIMING 10
+#define CONFIG_SYNTAX_EVENT      11
+#define CONFIG_SYNTAX_NOEVENT    12
+#define CONFIG_SYNTAX_ADAPTIVE   13
+#define CONFIG_SYNTAX_NOADAPTIVE 14
+#define CONFIG_SYNTAX_BGCALIB    15
+#define CONFIG_SYNTAX_NOBGCALIB  16
+#define CONFIG_SYNTAX_AUTOCALIB  17
+#define CONFIG_SYNTAX_NOAUTOCALIB 18
+#define CONFIG_SYNTAX_FILTER     19
+#define CONFIG_SYNTAX_PREDICT    20
+#define CONFIG_SYNTAX_NOPREDICT  21
+#define CONFIG_SYNTAX_AUTOTIMEOUT 22
+#define CONFIG_SYNTAX_NOAUTOTIMEOUT 23
+#define CONFIG_SYNTAX_HOTPLUG    24
+#define CONFIG_SYNTAX_NOHOTPLUG  25
+#define CONFIG_SYNTAX_STAGGER    26
+#define CONFIG_SYNTAX_NOSTAGGER  27
+#define CONFIG_SYNTAX_RETRY      28
+#define CONFIG_SYNTAX_NORETRY    29
+#define CONFIG_SYNTAX_ROBUSTCALIB 30
+#define CONFIG_SYNTAX_NOROBUSTCALIB 31
+#define CONFIG_SYNTAX_WARMSTART  32
+#define CONFIG_SYNTAX_NOWARMSTART 33
+
+static const char calib_syntax[] = "/E/A,/A,min/E/K,ctr/E/K,max/E/K,ctrzone/E/K,endzone/E/K,smooth/E/K,filter/K";
 #define CALIB_SYNTAX_JOYNUM    0
 #define CALIB_SYNTAX_XORY      1
 #define CALIB_SYNTAX_MIN       2
@@ -236,39 +690,107 @@ static const char calib_syntax[] = "/E/A,/A,min/E/K,ctr/E/K,max/E/K,ctrzone/E/K,
 #define CALIB_SYNTAX_CTRZONE   5
 #define CALIB_SYNTAX_ENDZONE   6
 #define CALIB_SYNTAX_SMOOTH    7
+#define CALIB_SYNTAX_FILTER    8
 
 static const char reinit_syntax[] = "/E";
 #define REINIT_SYNTAX_JOYNUM   0
 
+static const char stats_syntax[] = "reset/S";
+#define STATS_SYNTAX_RESET     0
+
+static const char save_syntax[] = "file";
+#define SAVE_SYNTAX_FILE       0
+
+static const char bench_syntax[] = "time/E/K,sweep/S";
+#define BENCH_SYNTAX_TIME      0
+#define BENCH_SYNTAX_SWEEP     1
+
 #define  UNUSED(x)             (x = x)
 /* (suppress strict compiler warnings about unused parameters) */
 
 /* ----------------------------------------------------------------------- */
 /*                       Function prototypes                               */
 
-#define STICK_0 (1u << 0)
-#define STICK_1 (1u << 1) /* flags for get_av_stick_pos() and reinit_joysticks() */
-
 #define X_BIAS_MIN (1u << 0)
 #define X_BIAS_MAX (1u << 1)
 #define Y_BIAS_MIN (1u << 2)
-#define Y_BIAS_MAX (1u << 3) /* directional bias for get_av_stick_pos() */
-
-static unsigned int read_joystick(unsigned int mask, unsigned int *lost);
+#define Y_BIAS_MAX (1u << 3) /* directional bias for finish_calib() */
+
+static unsigned int read_joystick(unsigned int mask, unsigned int probe, unsigned int *lost, unsigned int *axes_lost, unsigned int *raw_x, unsigned int *raw_y);
+static _kernel_oserror *find_gameports(void);
+static unsigned int lost_sticks(unsigned int axes_lost);
+static unsigned int start_gameports(unsigned int mask);
+static unsigned int read_gameports(void);
+static unsigned int axis_limit(const Axis *axis);
+static unsigned int stagger_axes(unsigned int mask);
+static unsigned int axis_deadline(unsigned int mask);
+static unsigned int clamp_axes(unsigned int timed_out, unsigned int wait, unsigned int *new_x, unsigned int *new_y);
+static bool near_max(const Axis *axis);
+static unsigned int resolve_axes(unsigned int joy, unsigned int wait, bool in_time, unsigned int mask, unsigned int *new_x, unsigned int *new_y, unsigned int *axes_lost);
+static void store_timings(const unsigned int *new_x, const unsigned int *new_y);
+static void publish_snapshot(void);
+static void update_state_block(const Snapshot *snap);
+static void read_snapshot(Snapshot *copy);
+static void predict_snapshot(Snapshot *snap);
+static signed int estimate_velocity(signed int old_vel, unsigned int prev_value, unsigned int new_value, unsigned int jitter, unsigned int interval);
+static unsigned int extrapolate(unsigned int value, signed int vel, unsigned int elapsed);
+static void raise_events(const Snapshot *prev, const Snapshot *next);
+static _kernel_oserror *prepare_read(unsigned int flags, void *pw);
+static _kernel_oserror *start_polling(void *pw);
+static _kernel_oserror *stop_polling(void *pw);
+static void warm_start_read(void);
+static _kernel_oserror *change_poll_rate(unsigned int old_delay, void *pw);
+static unsigned int client_axes(void);
+static unsigned int ticker_delay(void);
+static unsigned int stick_buttons(unsigned int joy, int stick_num);
+static void record_history(const unsigned int *new_x, const unsigned int *new_y);
+static void sample_buttons(void);
+static unsigned int sampled_buttons(unsigned int buttons, int stick_num);
+static unsigned int read_timestamp(void);
+static void reset_stats(void);
+static void count_read(unsigned int timed_out, unsigned int sticks_lost, unsigned int axes_lost);
+static void add_time(unsigned int time, unsigned int *t_min, unsigned int *t_max, unsigned int *t_total);
+static unsigned int mean(unsigned int total, unsigned int count);
+#ifdef STATS_HISTOGRAMS
+static void add_to_histogram(unsigned int time, unsigned int *hist);
+#endif
+static bool run_bench(unsigned int interval, unsigned int duration, BenchResult *res);
+static void show_bench(const BenchResult *res);
+static _kernel_oserror *claim_timer(void *pw);
+static _kernel_oserror *release_timer(void *pw);
+static _kernel_oserror *start_irq_read(unsigned int mask, void *pw);
+static _kernel_oserror *stop_irq_read(void *pw);
 static void recalc_coefficients(int sticks);
-static unsigned int smooth_value(unsigned int prev_value, unsigned int new_value, unsigned int stddev);
-static void get_av_stick_pos(unsigned int sticks, unsigned int *x_array, unsigned int *y_array, unsigned int *x_jitdist, unsigned int *y_jitdist, int bias);
+static void convert_position(int stick_num, unsigned int x_time, unsigned int y_time, unsigned int *pos8, unsigned int *pos16);
+static _kernel_oserror *calibrate(int goal, unsigned int sticks, void *pw);
+static _kernel_oserror *end_calib(void *pw);
+static void run_calib(void);
+static void start_calib(int goal, unsigned int sticks);
+static void start_averaging(void);
+static bool calib_step(void);
+static void finish_calib(void);
+static unsigned int calib_reads_left(void);
+static void track_calibration(const unsigned int *new_x, const unsigned int *new_y);
+static bool track_axis(Axis *axis, bool window_end);
+static void reset_tracking(unsigned int sticks);
+static void reset_filters(unsigned int sticks);
+static unsigned int hotplug_probe(void);
+static unsigned int bring_up(unsigned int probe, unsigned int timed_out, const unsigned int *new_x, const unsigned int *new_y);
+static unsigned int load_calib(const char *file_name);
+static _kernel_oserror *save_calib(const char *file_name);
+static int read_calib_file(const char *file_name, CalibRecord *records);
+static bool valid_record(const CalibRecord *rec);
+static void axis_from_record(Axis *axis, const AxisRecord *rec);
+static void axis_to_record(const Axis *axis, AxisRecord *rec);
 static int eval_expr(char *buffer);
-static void reinit_joysticks(unsigned int sticks);
-static void update_min_max(unsigned int *axis, unsigned int *jit_min, unsigned int *jit_max, int stick_num);
+static void update_min_max(unsigned int value, unsigned int *jit_min, unsigned int *jit_max);
+static void robust_estimate(const unsigned int *samples, int count, unsigned int *av, unsigned int *lo, unsigned int *hi);
 
 /* ----------------------------------------------------------------------- */
 /*                         Public functions                                */
 
 _kernel_oserror *MicoJoy_initialise(const char *cmd_tail, int podule_base, void *pw)
 {
-  char addr_buffer[10];
-  
   UNUSED(podule_base);
   UNUSED(cmd_tail);
 
@@ -281,17 +803,19 @@ _kernel_oserror *MicoJoy_initialise(const char *cmd_tail, int podule_base, void
   xsyslog_logmessage(log_name, "Initialising Joystick module", 1);
 #endif
 
-  /*
-    Check whether Plug'n'Play properly initialised
-  */
-  if(_kernel_getenv("PnPManager$GamesPort_Address", addr_buffer, sizeof(addr_buffer)) != NULL)
-    return &gameport_not_found;
   {
-    int matched= sscanf(addr_buffer, "&%x", &game_port_address);
-    if(matched == EOF || matched < 1)
-      return &gameport_not_found;
+    _kernel_oserror *e = find_gameports();
+    if(e != NULL)
+      return e;
   }
-  reinit_joysticks(STICK_0|STICK_1);
+  {
+    unsigned int loaded = load_calib(CALIB_FILE_READ);
+    if(loaded != ALL_STICKS) {
+      /* No saved calibration for some gameports */
+      calibrate(CALIB_GOAL_REINIT, ALL_STICKS & ~loaded, pw); /* (in the foreground, since -bgcalib is off) */
+    }
+  }
+  reset_stats();
   
   /* Attach routine to monitor whether Joystick SWIs are being called */
   return _swix(OS_CallEvery, _INR(0,2), MONITOR_INTERVAL, stoppoll_veneer, pw);
@@ -301,7 +825,7 @@ _kernel_oserror *MicoJoy_initialise(const char *cmd_tail, int podule_base, void
 
 _kernel_oserror *MicoJoy_swihandler(int swi_no, _kernel_swi_regs *r, void *private_word)
 {
-  if((swi_no == (Joystick_CalibrateTopRight-Joystick_00) || swi_no == (Joystick_CalibrateBottomLeft-Joystick_00)) && calib_status == CALIB_NONE && polling_stick) {
+  if((swi_no == (Joystick_CalibrateTopRight-Joystick_00) || swi_no == (Joystick_CalibrateBottomLeft-Joystick_00)) && calib_status == CALIB_NONE && polling_stick && !bg_calib) {
      /* cease polling stick for duration of calibration (just interferes) */
     _kernel_oserror *e;
 #ifdef DEBUG
@@ -316,119 +840,41 @@ _kernel_oserror *MicoJoy_swihandler(int swi_no, _kernel_swi_regs *r, void *priva
 #endif
     }
   }
+  if(swi_no == (Joystick_CalibrateTopRight-Joystick_00) || swi_no == (Joystick_CalibrateBottomLeft-Joystick_00)) {
+    /* timer interrupts would disrupt the gameport reads for calibration */
+    _kernel_oserror *e = stop_irq_read(private_word);
+    if(e != NULL)
+      return e;
+  }
 
   switch(swi_no) {
     case (Joystick_Read-Joystick_00):
 #ifdef DEBUG
       xsyslog_logmessage(log_name, "SWI Joystick_Read", 1);
 #endif
-      if(calib_status != CALIB_NONE)
-        return &error_calib; /* fail */
-
-      swi_in_last_min = true;
-      if(!polling_stick) {
-        /* Restart polling after a period of inactivity */
-        _kernel_oserror *e;
-        int stick_num;
-#ifdef DEBUG
-        xsyslog_logmessage(log_name, "Joystick_Read after inactivity - registering CallEvery to pollstick_veneer", 1);
-#endif
-        e = _swix(OS_CallEvery, _INR(0,2), poll_freq, pollstick_veneer, private_word);
+      {
+        _kernel_oserror *e = prepare_read(r->r[0], private_word);
         if(e != NULL)
-          return e;
-        polling_stick = true;
-        
-        /* We must assume that all values are terribly out of date */
-        for(stick_num = (NUM_STICKS-1); stick_num >= 0; stick_num--) {
-          int xc = x_ctr[stick_num], yc = y_ctr[stick_num];
-          x_axis[stick_num] = xc;
-          y_axis[stick_num] = yc;
-       } /* next stick_num */
-      } /* endif !polling_stick */
-
+          return e; /* fail */
+      }
       {
         unsigned char stick_num = r->r[0] & 0xff;
         unsigned char reason_code = (r->r[0] & 0xff00) >> 8;
+        Snapshot snap;
+
+        read_snapshot(&snap); /* positions all from the same poll */
+        if(reason_code <= 2)
+          predict_snapshot(&snap);
 
         switch(reason_code) {
           case 0:
             /* Read 8-bit state of an analogue or switched joystick */
-            if(stick_num < NUM_STICKS) {
-              /* First two joysticks are supported */
-              { /* Use cached stick positions */
-                signed int x, y;
-
-                /* calc joystick 8-bit position */
-#ifdef DEBUG
-                printf("x_axis[%d] = %u (%u-%u) y_axis[%d] = %u (%u-%u)\n", stick_num, x_axis[stick_num], x_min[stick_num], x_max[stick_num], stick_num, y_axis[stick_num], y_min[stick_num], y_max[stick_num]);
-#endif
-
-                if(x_axis[stick_num] > x_ctr_low[stick_num]) {
-                  if(x_axis[stick_num] < x_ctr_high[stick_num]) {
-                    /* In centre dead zone */
-                    x = 0;
-                  } else {
-                    /* Above centre dead zone */
-                    x = (x_high_scaler[stick_num] * (x_axis[stick_num] - x_ctr_high[stick_num])) >> (SCALER_FRAC_SHIFT+8);
-                  }
-                } else {
-                  /* Below centre dead zone */
-                  x = - ((x_low_scaler[stick_num] * (x_ctr_low[stick_num] - x_axis[stick_num])) >> (SCALER_FRAC_SHIFT+8));
-                }
-                /* Make absolutely sure value within range */
-                if(x < -127)
-                  x = -127;
-                else {
-                  if(x > 127)
-                    x = 127;
-                }
-
-                if(y_axis[stick_num] > y_ctr_low[stick_num]) {
-                  if(y_axis[stick_num] < y_ctr_high[stick_num]) {
-                    /* In centre dead zone */
-                    y = 0;
-                  } else {
-                    /* Above centre dead zone */
-#ifdef DEBUG
-                    printf("y = %d/%d\n",y_axis[stick_num] - y_ctr_high[stick_num], y_max[stick_num] - y_ctr_high[stick_num]);
-#endif
-                    y = -((y_high_scaler[stick_num] * (y_axis[stick_num] - y_ctr_high[stick_num])) >> (SCALER_FRAC_SHIFT+8));
-                  }
-                } else {
-                  /* Below centre dead zone */
-                  y = (y_low_scaler[stick_num] * (y_ctr_low[stick_num] - y_axis[stick_num])) >> (SCALER_FRAC_SHIFT+8);
-                }
-                /* Make absolutely sure value within range */
-                if(y < -127)
-                  y = -127;
-                else {
-                  if(y > 127)
-                    y = 127;
-                }
-
-                r->r[0] = (y & 0xff) | ((x & 0xff)<<8);
-              }
-              { /* Read fire buttons */
-                unsigned char joy;
-                unsigned int buttons;
-
-                joy = *game_port_address; /* read joystick status bits */
-                buttons = 0;
-                if(stick_num == 0) {
-                  /* return joystick A buttons */
-                  if(!(joy & PC_JOY_A_B1))
-                    buttons |= (1u<<16);
-                  if(!(joy & PC_JOY_A_B2))
-                    buttons |= (1u<<17);
-                } else {
-                  /* return joystick B buttons */
-                  if(!(joy & PC_JOY_B_B1))
-                    buttons |= (1u<<16);
-                  if(!(joy & PC_JOY_B_B2))
-                    buttons |= (1u<<17);
-                }
-                r->r[0] |= buttons;
-              }
+            if(stick_num < num_sticks) {
+              /* Joysticks on the gameports found are supported */
+              /* Use cached stick positions */
+              r->r[0] = snap.pos8[stick_num];
+              /* Use sampled fire buttons */
+              r->r[0] |= sampled_buttons(button_state, stick_num) << 16;
             }
             else {
               /* Other joysticks aren't supported */
@@ -437,82 +883,17 @@ _kernel_oserror *MicoJoy_swihandler(int swi_no, _kernel_swi_regs *r, void *priva
             break;
 
           case 1:
-            /* Read 16-bit state of an analogue joystick*/
-            if(stick_num < NUM_STICKS) {
-              /* First two joysticks are supported */
-
-              { /* Use cached stick positions */
-                signed int x, y;
-                /* calc joystick 16-bit position */
-#ifdef DEBUG
-                printf("x_axis[%d] = %u (%u-%u) y_axis[%d] = %u (%u-%u)\n", stick_num, x_axis[stick_num], x_min[stick_num], x_max[stick_num], stick_num, y_axis[stick_num], y_min[stick_num], y_max[stick_num]);
-#endif
-                if(x_axis[stick_num] > x_ctr_low[stick_num]) {
-                  if(x_axis[stick_num] < x_ctr_high[stick_num]) {
-                    /* In centre dead zone */
-                    x = 0x7fff;
-                  } else {
-                    /* Above centre dead zone */
-                    x = 0x7fff + ((x_high_scaler[stick_num] * (x_axis[stick_num] - x_ctr_high[stick_num])) >> SCALER_FRAC_SHIFT);
-                  }
-                } else {
-                  /* Below centre dead zone */
-                  x = 0x7fff - ((x_low_scaler[stick_num] * (x_ctr_low[stick_num] - x_axis[stick_num])) >> SCALER_FRAC_SHIFT);
-                }
-                /* Make absolutely sure value within range */
-                if(x < 0)
-                  x = 0;
-                else {
-                  if(x > 0xffff)
-                    x = 0xffff;
-                }
-
-                if(y_axis[stick_num] > y_ctr_low[stick_num]) {
-                  if(y_axis[stick_num] < y_ctr_high[stick_num]) {
-                    /* In centre dead zone */
-                    y = 0x7fff;
-                  } else {
-                    /* Above centre dead zone */
-#ifdef DEBUG
-                    printf("y = %d/%d\n",y_axis[stick_num] - y_ctr_high[stick_num], y_max[stick_num] - y_ctr_high[stick_num]);
-#endif
-                    y = 0x7fff - ((y_high_scaler[stick_num] * (y_axis[stick_num] - y_ctr_high[stick_num])) >> SCALER_FRAC_SHIFT);
-                  }
-                } else {
-                  /* Below centre dead zone */
-                  y = 0x7fff + ((y_low_scaler[stick_num] * (y_ctr_low[stick_num] - y_axis[stick_num])) >> SCALER_FRAC_SHIFT);
-                }
-                /* Make absolutely sure value within range */
-                if(y < 0)
-                  y = 0;
-                else {
-                  if(y > 0xffff)
-                    y = 0xffff;
-                }
-
-                r->r[0] = (y & 0xffff) | (x << 16);
-              }
-              { /* Read fire buttons */
-                unsigned char joy;
-                unsigned int buttons;
-
-                joy = *game_port_address; /* read joystick status bits */
-                buttons = 0;
-                if(stick_num == 0) {
-                  /* return joystick A buttons */
-                  if(!(joy & PC_JOY_A_B1))
-                    buttons |= (1u<<0);
-                  if(!(joy & PC_JOY_A_B2))
-                    buttons |= (1u<<1);
-                } else {
-                  /* return joystick B buttons */
-                  if(!(joy & PC_JOY_B_B1))
-                    buttons |= (1u<<0);
-                  if(!(joy & PC_JOY_B_B2))
-                    buttons |= (1u<<1);
-                }
-                r->r[1] = buttons;
-              }
+          case 2:
+            /* Read 16-bit state of an analogue joystick (and sample count) */
+            if(reason_code == 2)
+              r->r[2] = snap.samples;
+
+            if(stick_num < num_sticks) {
+              /* Joysticks on the gameports found are supported */
+              /* Use cached stick positions */
+              r->r[0] = snap.pos16[stick_num];
+              /* Use sampled fire buttons */
+              r->r[1] = sampled_buttons(button_state, stick_num);
             }
             else {
               /* Other joysticks aren't supported */
@@ -521,6 +902,69 @@ _kernel_oserror *MicoJoy_swihandler(int swi_no, _kernel_swi_regs *r, void *priva
             }
             break;
 
+          case 3:
+            /* Read fire buttons, and those pressed or released since last time */
+            if(stick_num < num_sticks) {
+              /* Joysticks on the gameports found are supported */
+              /* Take and clear the latches without pollstick_handler intervening */
+              unsigned int clear = 0xffu << (stick_num * 8);
+              _kernel_irqs_off();
+              r->r[0] = sampled_buttons(button_state, stick_num);
+              r->r[1] = sampled_buttons(button_pressed, stick_num);
+              r->r[2] = sampled_buttons(button_released, stick_num);
+              button_pressed &= ~clear;
+              button_released &= ~clear;
+              _kernel_irqs_on();
+            }
+            else {
+              /* Other joysticks aren't supported */
+              r->r[0] = 0; /* nothing pressed */
+              r->r[1] = 0;
+              r->r[2] = 0;
+            }
+            break;
+
+          case 4:
+            /* Read axis timings, and the calibration values they are converted with */
+            if(stick_num < num_sticks) {
+              /* Joysticks on the gameports found are supported */
+              const Axis *x = &stick[stick_num].x, *y = &stick[stick_num].y;
+              r->r[0] = snap.x_axis[stick_num];
+              r->r[1] = snap.y_axis[stick_num]; /* (smoothed) */
+              r->r[2] = snap.x_raw[stick_num];
+              r->r[3] = snap.y_raw[stick_num];
+              r->r[4] = x->min;
+              r->r[5] = x->ctr;
+              r->r[6] = x->max;
+              r->r[7] = y->min;
+              r->r[8] = y->ctr;
+              r->r[9] = y->max;
+            }
+            else {
+              /* Other joysticks aren't supported */
+              int reg;
+              for(reg = 0; reg <= 9; reg++)
+                r->r[reg] = 0;
+            }
+            break;
+
+          case 5:
+            /* Read high-resolution state of an analogue joystick */
+            if(stick_num < num_sticks) {
+              /* Joysticks on the gameports found are supported */
+              r->r[0] = convert_fixed(&stick[stick_num].x.coeffs, snap.x_axis[stick_num]);
+              r->r[1] = -convert_fixed(&stick[stick_num].y.coeffs, snap.y_axis[stick_num]); /* y axis timings are inverted */
+              /* Use sampled fire buttons */
+              r->r[2] = sampled_buttons(button_state, stick_num);
+            }
+            else {
+              /* Other joysticks aren't supported */
+              r->r[0] = 0;
+              r->r[1] = 0; /* centre position */
+              r->r[2] = 0; /* switch state */
+            }
+            break;
+
           default:
             /* Unknown reason code! */
             return &bad_reason; /* fail */
@@ -528,70 +972,203 @@ _kernel_oserror *MicoJoy_swihandler(int swi_no, _kernel_swi_regs *r, void *priva
       }
       return NULL; /* success */
 
-    case (Joystick_CalibrateTopRight-Joystick_00):
-      {
+    case (Joystick_ReadAll-Joystick_00):
 #ifdef DEBUG
-        xsyslog_logmessage(log_name, "SWI Joystick_CalibrateTopRight", 1);
+      xsyslog_logmessage(log_name, "SWI Joystick_ReadAll", 1);
 #endif
-  
-        calib_status |= CALIB_TOP_RIGHT;
-        if(calib_status == (CALIB_TOP_RIGHT|CALIB_BOTTOM_LEFT)) {
-          unsigned int x_jitdist[2], y_jitdist[2];
-          int stick_num;
+      {
+        _kernel_oserror *e = prepare_read(r->r[0], private_word);
+        if(e != NULL)
+          return e; /* fail */
+      }
+      {
+        /*
+           Fill caller's block with the state of every stick from one
+           snapshot, and one sample of the buttons
+        */
+        unsigned int *block = (unsigned int *)r->r[1];
+        int max_sticks = r->r[2], stick_num;
+        unsigned int joy_buttons = button_state;
+        Snapshot snap;
+
+        read_snapshot(&snap);
+        predict_snapshot(&snap);
+
+        for(stick_num = 0; stick_num < num_sticks && stick_num < max_sticks; stick_num++) {
+          unsigned int buttons = sampled_buttons(joy_buttons, stick_num);
+          block[0] = snap.pos8[stick_num] | (buttons << 16);
+          block[1] = snap.pos16[stick_num];
+          block[2] = buttons;
+          block += JOY_READALL_WORDS;
+        } /* next stick_num */
+        r->r[2] = stick_num; /* number of entries filled */
+        r->r[3] = snap.samples;
+      }
+      return NULL; /* success */
 
-          get_av_stick_pos(STICK_0|STICK_1, x_max, y_min, x_jitdist, y_jitdist, X_BIAS_MIN|Y_BIAS_MAX);
-          for(stick_num = (NUM_STICKS-1); stick_num >= 0; stick_num--) {
-            if(x_jitdist[stick_num] > x_end_deadz[stick_num])
-              x_end_deadz[stick_num] = x_jitdist[stick_num];
-       
-            if(y_jitdist[stick_num] > y_end_deadz[stick_num])
-              y_end_deadz[stick_num] = y_jitdist[stick_num];
-          }
-          
-          /* calibration complete */
-          recalc_coefficients(STICK_0|STICK_1);
-          calib_status = CALIB_NONE;
-        } else {
-          get_av_stick_pos(STICK_0|STICK_1, x_max, y_min, x_end_deadz, y_end_deadz, X_BIAS_MIN|Y_BIAS_MAX);
+    case (Joystick_ReadHistory-Joystick_00):
+#ifdef DEBUG
+      xsyslog_logmessage(log_name, "SWI Joystick_ReadHistory", 1);
+#endif
+      {
+        _kernel_oserror *e = prepare_read(r->r[0], private_word);
+        if(e != NULL)
+          return e; /* fail */
+      }
+      {
+        /*
+           Copy records of all polls since the caller's cursor
+           (oldest first), as far as will fit in the caller's buffer
+        */
+        unsigned int cursor = r->r[1], count = history_count, lost = 0;
+        HistoryRecord *buffer = (HistoryRecord *)r->r[2];
+        int max_records = r->r[3], copied = 0;
+
+        if(count - cursor > HISTORY_SIZE) {
+          /* Oldest records wanted have been overwritten */
+          lost = count - cursor - HISTORY_SIZE;
+          cursor = count - HISTORY_SIZE;
         }
+        while(cursor != count && copied < max_records) {
+          buffer[copied++] = history[cursor % HISTORY_SIZE];
+          cursor++;
+        }
+        r->r[1] = cursor;
+        r->r[3] = copied;
+        r->r[4] = lost;
       }
       return NULL; /* success */
 
-    case (Joystick_CalibrateBottomLeft-Joystick_00):
+    case (Joystick_ReadStats-Joystick_00):
+#ifdef DEBUG
+      xsyslog_logmessage(log_name, "SWI Joystick_ReadStats", 1);
+#endif
       {
+        /* Copy as much of the counters as will fit in the caller's block */
+        unsigned int size = r->r[2];
+        if(size > sizeof(stats))
+          size = sizeof(stats);
+        _kernel_irqs_off();
+        memcpy((void *)r->r[1], &stats, size);
+        if(r->r[0] & 1)
+          reset_stats(); /* bit 0 of flags set */
+        _kernel_irqs_on();
+        /* (We ASSUME that by doing this we are restoring the entry state) */
+        r->r[2] = size;
+      }
+      return NULL; /* success */
+
+    case (Joystick_CalibrationStatus-Joystick_00):
+#ifdef DEBUG
+      xsyslog_logmessage(log_name, "SWI Joystick_CalibrationStatus", 1);
+#endif
+      r->r[0] = (calib_status << 1) | (calib_job.phase != CALIB_PHASE_IDLE ? 1 : 0);
+      if(calib_job.phase != CALIB_PHASE_IDLE) {
+        r->r[1] = calib_job.reads;
+        r->r[2] = calib_reads_left();
+      } else {
+        r->r[1] = 0;
+        r->r[2] = 0;
+      }
+      return NULL; /* success */
+
+    case (Joystick_CalibrateTopRight-Joystick_00):
 #ifdef DEBUG
-        xsyslog_logmessage(log_name, "SWI Joystick_CalibrateBottomLeft", 1);
+      xsyslog_logmessage(log_name, "SWI Joystick_CalibrateTopRight", 1);
 #endif
+      return calibrate(CALIB_GOAL_TOP_RIGHT, ALL_STICKS, private_word);
 
-        calib_status |= CALIB_BOTTOM_LEFT;
-        if(calib_status == (CALIB_TOP_RIGHT|CALIB_BOTTOM_LEFT)) {
-          unsigned int x_jitdist[2], y_jitdist[2];
-          int stick_num;
+    case (Joystick_CalibrateBottomLeft-Joystick_00):
+#ifdef DEBUG
+      xsyslog_logmessage(log_name, "SWI Joystick_CalibrateBottomLeft", 1);
+#endif
+      return calibrate(CALIB_GOAL_BOTTOM_LEFT, ALL_STICKS, private_word);
 
-          get_av_stick_pos(STICK_0|STICK_1, x_min, y_max, x_jitdist, y_jitdist, X_BIAS_MAX|Y_BIAS_MIN);
-          for(stick_num = (NUM_STICKS-1); stick_num >= 0; stick_num--) {
-            if(x_jitdist[stick_num] > x_end_deadz[stick_num])
-              x_end_deadz[stick_num] = x_jitdist[stick_num];
-       
-            if(y_jitdist[stick_num] > y_end_deadz[stick_num])
-              y_end_deadz[stick_num] = y_jitdist[stick_num];
-          }
-          
-          /* calibration complete */
-          recalc_coefficients(STICK_0|STICK_1);
-          calib_status = CALIB_NONE;
-        } else {
-          get_av_stick_pos(STICK_0|STICK_1, x_min, y_max, x_end_deadz, y_end_deadz, X_BIAS_MAX|Y_BIAS_MIN);
+    case (Joystick_Register-Joystick_00):
+#ifdef DEBUG
+      xsyslog_logmessage(log_name, "SWI Joystick_Register", 1);
+#endif
+      {
+        unsigned int old_delay = ticker_delay();
+        int client_num;
+        _kernel_oserror *e;
+
+        for(client_num = 0; client_num < MAX_CLIENTS && client[client_num].used; client_num++)
+          ; /* find a free entry */
+        if(client_num >= MAX_CLIENTS)
+          return &error_too_many_clients; /* fail */
+
+        client[client_num].axes = r->r[1];
+        client[client_num].interval = r->r[2];
+        _swix(OS_ReadMonotonicTime, _OUT(0), &client[client_num].next_time); /* due straight away */
+        client[client_num].used = true;
+        num_clients++;
+
+        if(polling_stick)
+          e = change_poll_rate(old_delay, private_word); /* (may need to poll more often) */
+        else {
+          if(calib_status == CALIB_NONE)
+            e = start_polling(private_word);
+          else
+            e = NULL; /* end_calib restarts polling once calibration is complete */
+        }
+        if(e != NULL) {
+          client[client_num].used = false;
+          num_clients--;
+          return e; /* fail */
         }
+        r->r[0] = client_num + 1; /* handle */
       }
       return NULL; /* success */
 
-    default:
-      return error_BAD_SWI; /* fail */
-  }
-}
+    case (Joystick_Deregister-Joystick_00):
+#ifdef DEBUG
+      xsyslog_logmessage(log_name, "SWI Joystick_Deregister", 1);
+#endif
+      {
+        unsigned int handle = r->r[0], old_delay = ticker_delay();
 
-/* ----------------------------------------------------------------------- */
+        if(handle == 0 || handle > MAX_CLIENTS || !client[handle-1].used)
+          return &error_bad_client; /* fail */
+
+        client[handle-1].used = false;
+        num_clients--;
+
+        if(num_clients == 0 && !swi_in_last_min && !events && calib_job.phase == CALIB_PHASE_IDLE) {
+          /* Last client gone - stop polling now rather than waiting for stoppoll_handler */
+          return stop_polling(private_word);
+        }
+        return change_poll_rate(old_delay, private_word);
+      }
+
+    case (Joystick_StateBlock-Joystick_00):
+#ifdef DEBUG
+      xsyslog_logmessage(log_name, "SWI Joystick_StateBlock", 1);
+#endif
+      if(state_block == NULL) {
+        /* First request - claim the block, and fill it in from the current snapshot */
+        StateBlock *block;
+        _kernel_oserror *e = _swix(OS_Module, _IN(0)|_IN(3)|_OUT(2), 6, sizeof(StateBlock), &block);
+        if(e != NULL)
+          return e; /* fail */
+
+        memset(block, 0, sizeof(StateBlock));
+        block->version = STATE_BLOCK_VERSION;
+        block->size = sizeof(StateBlock);
+        block->num_sticks = num_sticks;
+        state_block = block;
+        update_state_block(&snapshot[snapshot_seq & 1]);
+      }
+      r->r[0] = (int)state_block;
+      r->r[1] = sizeof(StateBlock);
+      return NULL; /* success */
+
+    default:
+      return error_BAD_SWI; /* fail */
+  }
+}
+
+/* ----------------------------------------------------------------------- */
 
 _kernel_oserror *MicoJoy_cmdhandler(const char *arg_string, int argc, int cmd_no, void *pw)
 {
@@ -604,35 +1181,191 @@ _kernel_oserror *MicoJoy_cmdhandler(const char *arg_string, int argc, int cmd_no
 
     case CMD_JoystickInfo:
       /* Syntax: *JoystickInfo */
-      printf("Axis Minimum Centre Maximum Ctr zone End zone Smooth\n");
-      printf("---- ------- ------ ------- -------- -------- ------\n");
+      printf("Axis Minimum Centre Maximum Ctr zone End zone Smooth Filter\n");
+      printf("---- ------- ------ ------- -------- -------- ------ --------\n");
       {
         int stick_num;
-        for(stick_num = 0; stick_num < NUM_STICKS; stick_num++) {
+        for(stick_num = 0; stick_num < num_sticks; stick_num++) {
           printf(" %d X", stick_num);
-          printf(" %7u %6u %7u %8u %8u %6u\n", x_min[stick_num], x_ctr[stick_num], x_max[stick_num], x_ctr_deadz[stick_num], x_end_deadz[stick_num], x_smooth[stick_num]);
+          printf(" %7u %6u %7u %8u %8u %6u %s\n", stick[stick_num].x.min, stick[stick_num].x.ctr, stick[stick_num].x.max, stick[stick_num].x.ctr_deadz, stick[stick_num].x.end_deadz, stick[stick_num].x.smooth, filter_name(stick[stick_num].x.filter));
           /* (split so that the longer formatting string can be re-used) */
           printf(" %d Y", stick_num);
-          printf(" %7u %6u %7u %8u %8u %6u\n", y_min[stick_num], y_ctr[stick_num], y_max[stick_num], y_ctr_deadz[stick_num], y_end_deadz[stick_num], y_smooth[stick_num]);
+          printf(" %7u %6u %7u %8u %8u %6u %s\n", stick[stick_num].y.min, stick[stick_num].y.ctr, stick[stick_num].y.max, stick[stick_num].y.ctr_deadz, stick[stick_num].y.end_deadz, stick[stick_num].y.smooth, filter_name(stick[stick_num].y.filter));
+        } /* next stick_num */
+      }
+      break;
+
+    case CMD_JoystickSave:
+      /* Syntax: *JoystickSave [<filename>] */
+      {
+        /*
+           Can have no more than 1 arg, being a string. Allow one memory word for this element, plus sufficient buffer space for the string.
+        */
+        char *args_buf[1 + 64];
+        {
+          _kernel_oserror *e = _swix(OS_ReadArgs, _INR(0,3), save_syntax, arg_string, args_buf, sizeof(args_buf));
+          if(e != NULL)
+            return e;
+        }
+        if(args_buf[SAVE_SYNTAX_FILE] != 0)
+          return save_calib(args_buf[SAVE_SYNTAX_FILE]);
+      }
+      {
+        /* Save in <Choices$Write>.Joystick */
+        char file_name[256];
+        if(_kernel_getenv(CALIB_FILE_WRITE_DIR, file_name, sizeof(file_name) - sizeof(CALIB_FILE_LEAF) - 1) != NULL)
+          return &error_save_failed; /* fail */
+        strcat(file_name, "." CALIB_FILE_LEAF);
+        return save_calib(file_name);
+      }
+
+    case CMD_JoystickStats:
+      /* Syntax: *JoystickStats [-reset] */
+      {
+        /*
+           Can have no more than 1 arg, being a switch. Allow one memory word for this element.
+        */
+        char *args_buf[(1*4)];
+        Stats copy;
+        int stick_num;
+        {
+          _kernel_oserror *e = _swix(OS_ReadArgs, _INR(0,3), stats_syntax, arg_string, args_buf, sizeof(args_buf));
+          if(e != NULL)
+            return e;
+        }
+        _kernel_irqs_off();
+        copy = stats;
+        if(args_buf[STATS_SYNTAX_RESET] != 0)
+          reset_stats();
+        _kernel_irqs_on();
+
+        printf("Polls: %u (%u skipped because a read was in progress)\n", copy.polls, copy.skipped);
+        printf("Reads: %u\n\n", copy.reads);
+        printf("Stick Lost X lost Y lost X timeout Y timeout\n");
+        printf("----- ---- ------ ------ --------- ---------\n");
+        for(stick_num = 0; stick_num < num_sticks; stick_num++)
+          printf("%5d %4u %6u %6u %9u %9u\n", stick_num, copy.lost[stick_num], copy.axis_lost[stick_num*2], copy.axis_lost[stick_num*2+1], copy.timeouts[stick_num*2], copy.timeouts[stick_num*2+1]);
+
+        printf("\nTime           Minimum   Mean Maximum\n");
+        printf("-------------- ------- ------ -------\n");
+        printf("Read           %7u %6u %7u\n", copy.reads ? copy.read_min : 0, mean(copy.read_total, copy.reads), copy.read_max);
+        printf("CallBack delay %7u %6u %7u\n", copy.delays ? copy.delay_min : 0, mean(copy.delay_total, copy.delays), copy.delay_max);
+#ifdef STATS_HISTOGRAMS
+        {
+          int bucket;
+          printf("\nTime from  CallBack delay    Read Interval\n");
+          printf("---------- -------------- ------- --------\n");
+          for(bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+            if(copy.delay_hist[bucket] != 0 || copy.read_hist[bucket] != 0 || copy.interval_hist[bucket] != 0)
+              printf("%10u %14u %7u %8u\n", bucket ? (1u << bucket) : 0, copy.delay_hist[bucket], copy.read_hist[bucket], copy.interval_hist[bucket]);
+          } /* next bucket */
+        }
+#endif
+      }
+      break;
+
+    case CMD_JoystickBench:
+      /* Syntax: *JoystickBench [-time <seconds>] [-sweep] */
+      {
+        /*
+           Can have no more than 3 args - 1 evaluated element with identifier (2 args) and 1 switch. Allow one memory word for each element, plus sufficient buffer space for the evaluated element block.
+        */
+        char *args_buf[(2*4) + 8];
+        unsigned int duration = BENCH_DEFAULT_TIME;
+        BenchResult first, res;
+        int stick_num;
+        {
+          _kernel_oserror *e = _swix(OS_ReadArgs, _INR(0,3), bench_syntax, arg_string, args_buf, sizeof(args_buf));
+          if(e != NULL)
+            return e;
+        }
+        if(calib_job.phase != CALIB_PHASE_IDLE)
+          return &error_calib_busy; /* fail */
+        {
+          _kernel_oserror *e = stop_irq_read(pw);
+          if(e != NULL)
+            return e;
+        }
+        if(args_buf[BENCH_SYNTAX_TIME] != 0) {
+          int seconds = eval_expr(args_buf[BENCH_SYNTAX_TIME]);
+          if(seconds < 1)
+            seconds = 1;
+          if(seconds > BENCH_MAX_TIME)
+            seconds = BENCH_MAX_TIME;
+          duration = seconds;
+        }
+
+        printf("Interval   Reads Minimum   Mean Maximum CPU %%   Lost Timeouts\n");
+        printf("-------- ------- ------- ------ ------- ----- ------ --------\n");
+        if(!run_bench(0, duration * 100, &first)) {
+          _swix(OS_Byte, _IN(0), 126); /* acknowledge escape */
+          return &error_escape;
+        }
+        show_bench(&first);
+
+        if(args_buf[BENCH_SYNTAX_SWEEP] != 0) {
+          /* Read at each rate from the fastest possible up to the configured poll frequency */
+          unsigned int interval;
+          for(interval = MIN_POLL_INTERVAL; interval <= poll_freq+1; interval++) {
+            if(!run_bench(interval, duration * 100, &res)) {
+              _swix(OS_Byte, _IN(0), 126); /* acknowledge escape */
+              return &error_escape;
+            }
+            show_bench(&res);
+          } /* next interval */
+        }
+
+        printf("\nAxis    Lost Timeouts  Range\n");
+        printf("---- ------- -------- ------\n");
+        for(stick_num = 0; stick_num < num_sticks; stick_num++) {
+          int axis;
+          for(axis = stick_num*2; axis <= stick_num*2+1; axis++) {
+            unsigned int lost;
+            /* (axis numbers are in the same order as the axis bits) */
+            safedivide(lost, first.axis_lost[axis] * 1000, first.reads); /* (in tenths of a percent) */
+            printf(" %d %c %3u.%u%% %8u", stick_num, (axis & 1) ? 'Y' : 'X', lost / 10, lost % 10, first.timeouts[axis]);
+            if(first.pos_min[axis] <= first.pos_max[axis])
+              printf(" %6d\n", first.pos_max[axis] - first.pos_min[axis]);
+            else
+              printf("      -\n"); /* never read */
+          } /* next axis */
         } /* next stick_num */
       }
       break;
       
     case CMD_JoystickConfig:
-      /* Syntax: *JoystickConfig [-smooth|-nosmooth] [-ctrzone|-noctrzone] [-endzone|-noendzone] [-tolerance <interval>] [-timeout <delay>] [-poll <frequency>] */
+      /* Syntax: *JoystickConfig [-smooth|-nosmooth] [-ctrzone|-noctrzone] [-endzone|-noendzone] [-irqtiming|-noirqtiming] [-event|-noevent] [-tolerance <interval>] [-timeout <delay>] [-poll <frequency>] [-adaptive <ceiling>|-noadaptive] [-bgcalib|-nobgcalib] [-autocalib|-noautocalib] [-filter <type>] [-predict <time>|-nopredict] [-autotimeout|-noautotimeout] [-hotplug|-nohotplug] [-stagger <polls>|-nostagger] [-retry <count>|-noretry] [-robustcalib|-norobustcalib] [-warmstart|-nowarmstart] */
       if(argc > 0) {
         /*
-           Can have no more than 9 args - the worst case includes all 3 evaluated elements (6 args) and 3 of the possible switches (3 args). Allow one memory word for each element, plus sufficient buffer space for evaluated element blocks.
+           Can have no more than 27 args - the worst case includes all 7 evaluated elements (14 args), 1 string element with identifier (2 args) and 11 of the possible switches (11 args). Allow one memory word for each element, plus sufficient buffer space for evaluated element blocks, plus a bit extra for the string.
          */
-        char *args_buf[(6*4) + (3*8)];
+        char *args_buf[(34*4) + (7*8) + 4];
+        int filter = -1;
         {
           _kernel_oserror *e = _swix(OS_ReadArgs, _INR(0,3), config_syntax, arg_string, args_buf, sizeof(args_buf));
           if(e != NULL)
             return e;
         }
+        if(args_buf[CONFIG_SYNTAX_FILTER] != 0) {
+          filter = find_filter((char *)args_buf[CONFIG_SYNTAX_FILTER]);
+          if(filter < 0)
+            return &error_bad_filter;
+        }
         if((args_buf[CONFIG_SYNTAX_SMOOTH] != 0 && args_buf[CONFIG_SYNTAX_NOSMOOTH] != 0)
         || (args_buf[CONFIG_SYNTAX_CTRZONE] != 0 && args_buf[CONFIG_SYNTAX_NOCTRZONE] != 0)
-        || (args_buf[CONFIG_SYNTAX_ENDZONE] != 0 && args_buf[CONFIG_SYNTAX_NOENDZONE] != 0)) {
+        || (args_buf[CONFIG_SYNTAX_ENDZONE] != 0 && args_buf[CONFIG_SYNTAX_NOENDZONE] != 0)
+        || (args_buf[CONFIG_SYNTAX_IRQTIMING] != 0 && args_buf[CONFIG_SYNTAX_NOIRQTIMING] != 0)
+        || (args_buf[CONFIG_SYNTAX_EVENT] != 0 && args_buf[CONFIG_SYNTAX_NOEVENT] != 0)
+        || (args_buf[CONFIG_SYNTAX_ADAPTIVE] != 0 && args_buf[CONFIG_SYNTAX_NOADAPTIVE] != 0)
+        || (args_buf[CONFIG_SYNTAX_BGCALIB] != 0 && args_buf[CONFIG_SYNTAX_NOBGCALIB] != 0)
+        || (args_buf[CONFIG_SYNTAX_AUTOCALIB] != 0 && args_buf[CONFIG_SYNTAX_NOAUTOCALIB] != 0)
+        || (args_buf[CONFIG_SYNTAX_PREDICT] != 0 && args_buf[CONFIG_SYNTAX_NOPREDICT] != 0)
+        || (args_buf[CONFIG_SYNTAX_AUTOTIMEOUT] != 0 && args_buf[CONFIG_SYNTAX_NOAUTOTIMEOUT] != 0)
+        || (args_buf[CONFIG_SYNTAX_HOTPLUG] != 0 && args_buf[CONFIG_SYNTAX_NOHOTPLUG] != 0)
+        || (args_buf[CONFIG_SYNTAX_STAGGER] != 0 && args_buf[CONFIG_SYNTAX_NOSTAGGER] != 0)
+        || (args_buf[CONFIG_SYNTAX_RETRY] != 0 && args_buf[CONFIG_SYNTAX_NORETRY] != 0)
+        || (args_buf[CONFIG_SYNTAX_ROBUSTCALIB] != 0 && args_buf[CONFIG_SYNTAX_NOROBUSTCALIB] != 0)
+        || (args_buf[CONFIG_SYNTAX_WARMSTART] != 0 && args_buf[CONFIG_SYNTAX_NOWARMSTART] != 0)) {
           /* both 'smooth' and 'nosmooth' */
           return &error_command_syntax;
         }
@@ -667,37 +1400,165 @@ _kernel_oserror *MicoJoy_cmdhandler(const char *arg_string, int argc, int cmd_no
             }
           }
           if(recalc)
-            recalc_coefficients(STICK_0|STICK_1); /* Make it so */
+            recalc_coefficients(ALL_STICKS); /* Make it so */
         }
         
+        if(args_buf[CONFIG_SYNTAX_IRQTIMING] != 0) {
+          /* time axes from timer interrupts (timer 1 is kept until -noirqtiming) */
+          _kernel_oserror *e = claim_timer(pw);
+          if(e != NULL)
+            return e;
+          irq_timing = true;
+        }
+        else {
+          if(args_buf[CONFIG_SYNTAX_NOIRQTIMING] != 0) {
+            /* busy-wait for axes, as normal */
+            _kernel_oserror *e = stop_irq_read(pw);
+            if(e == NULL)
+              e = release_timer(pw);
+            if(e != NULL)
+              return e;
+            irq_timing = false;
+          }
+        }
+
+        if(args_buf[CONFIG_SYNTAX_EVENT] != 0)
+          events = true; /* raise events when sticks change */
+        else {
+          if(args_buf[CONFIG_SYNTAX_NOEVENT] != 0)
+            events = false;
+        }
+
+        if(args_buf[CONFIG_SYNTAX_BGCALIB] != 0)
+          bg_calib = true; /* calibrate whilst polling */
+        else {
+          if(args_buf[CONFIG_SYNTAX_NOBGCALIB] != 0) {
+            bg_calib = false;
+            run_calib(); /* finish any calibration in progress */
+          }
+        }
+
+        if(args_buf[CONFIG_SYNTAX_AUTOCALIB] != 0) {
+          if(!autocalib) {
+            reset_tracking(ALL_STICKS);
+            autocalib = true; /* follow drift of calibration values */
+          }
+        } else {
+          if(args_buf[CONFIG_SYNTAX_NOAUTOCALIB] != 0)
+            autocalib = false;
+        }
+
+        if(filter >= 0) {
+          /* Use the same filter for all axes */
+          int stick_num;
+          for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+            stick[stick_num].x.filter = filter;
+            stick[stick_num].y.filter = filter;
+          } /* next stick_num */
+          reset_filters(ALL_STICKS);
+        }
+
+        if(args_buf[CONFIG_SYNTAX_PREDICT] != 0) {
+          int time = eval_expr(args_buf[CONFIG_SYNTAX_PREDICT]);
+          if(time < 0)
+            time = 0;
+          if(time > MAX_PREDICT_TIME)
+            time = MAX_PREDICT_TIME;
+          predict_time = time; /* extrapolate positions beyond the last poll */
+        } else {
+          if(args_buf[CONFIG_SYNTAX_NOPREDICT] != 0)
+            predict_time = 0;
+        }
+
+        if(args_buf[CONFIG_SYNTAX_AUTOTIMEOUT] != 0)
+          auto_timeout = true; /* give up soon after calibrated max */
+        else {
+          if(args_buf[CONFIG_SYNTAX_NOAUTOTIMEOUT] != 0)
+            auto_timeout = false;
+        }
+
+        if(args_buf[CONFIG_SYNTAX_HOTPLUG] != 0) {
+          hotplug = true; /* look for joysticks being plugged in */
+          hotplug_polls = 0;
+        } else {
+          if(args_buf[CONFIG_SYNTAX_NOHOTPLUG] != 0)
+            hotplug = false;
+        }
+
+        if(args_buf[CONFIG_SYNTAX_STAGGER] != 0) {
+          int polls = eval_expr(args_buf[CONFIG_SYNTAX_STAGGER]);
+          if(polls < 2)
+            polls = 0; /* every poll is the same as not staggering */
+          if(polls > MAX_STAGGER)
+            polls = MAX_STAGGER;
+          stagger = polls; /* read slow axes less often */
+          stagger_polls = 0;
+        } else {
+          if(args_buf[CONFIG_SYNTAX_NOSTAGGER] != 0)
+            stagger = 0;
+        }
+
+        if(args_buf[CONFIG_SYNTAX_RETRY] != 0) {
+          int count = eval_expr(args_buf[CONFIG_SYNTAX_RETRY]);
+          if(count < 0)
+            count = 0;
+          if(count > MAX_RETRIES)
+            count = MAX_RETRIES;
+          retries = count; /* re-read lost axes straight away */
+        } else {
+          if(args_buf[CONFIG_SYNTAX_NORETRY] != 0)
+            retries = 0;
+        }
+
+        if(args_buf[CONFIG_SYNTAX_ROBUSTCALIB] != 0)
+          robust_calib = true; /* reject outliers when calibrating */
+        else {
+          if(args_buf[CONFIG_SYNTAX_NOROBUSTCALIB] != 0)
+            robust_calib = false;
+        }
+
+        if(args_buf[CONFIG_SYNTAX_WARMSTART] != 0)
+          warm_start = true; /* read sticks straight away when polling restarts */
+        else {
+          if(args_buf[CONFIG_SYNTAX_NOWARMSTART] != 0)
+            warm_start = false;
+        }
+
         if(args_buf[CONFIG_SYNTAX_TOLERANCE] != 0)
           tolerance = eval_expr(args_buf[CONFIG_SYNTAX_TOLERANCE]);
 
         if(args_buf[CONFIG_SYNTAX_TIMEOUT] != 0)
           max_wait = eval_expr(args_buf[CONFIG_SYNTAX_TIMEOUT]);
           
-        if(args_buf[CONFIG_SYNTAX_POLL] != 0) {
-          int new_freq = eval_expr(args_buf[CONFIG_SYNTAX_POLL]) - 1;
-          if(new_freq <= 0)
-            new_freq = 1; /* minimum delay is 2 centiseconds */
-
-          if(new_freq != poll_freq) {
-            if(polling_stick) {
-              /* First stop polling at old frequency */
-              _kernel_oserror *e = _swix(OS_RemoveTickerEvent, _INR(0,1), pollstick_veneer, pw);
-              if(e != NULL)
-                return e;
-           
-              /* Now start polling at new frequency */
-              e = _swix(OS_CallEvery, _INR(0,2), new_freq, pollstick_veneer, pw);
-              if(e != NULL) {
-                polling_stick = false; /* we've buggered it up */
-                return e;
-              } /* endif e != NULL */
-            }
+        {
+          unsigned int old_delay = ticker_delay();
+
+          if(args_buf[CONFIG_SYNTAX_POLL] != 0) {
+            int new_freq = eval_expr(args_buf[CONFIG_SYNTAX_POLL]) - 1;
+            if(new_freq <= 0)
+              new_freq = 1; /* minimum delay is 2 centiseconds */
+
             poll_freq = new_freq; /* store new poll frequency */
-          } /* endif new_freq != poll_freq */
-        } /* endif args_buf[CONFIG_SYNTAX_TOLERANCE] != 0 */
+          } /* endif args_buf[CONFIG_SYNTAX_POLL] != 0 */
+
+          if(args_buf[CONFIG_SYNTAX_ADAPTIVE] != 0) {
+            int ceiling = eval_expr(args_buf[CONFIG_SYNTAX_ADAPTIVE]);
+            if(ceiling < MIN_POLL_INTERVAL)
+              ceiling = MIN_POLL_INTERVAL;
+            adaptive_ceiling = ceiling; /* poll rate varies with stick activity */
+            poll_interval = MIN_POLL_INTERVAL;
+            poll_countdown = 1;
+          } else {
+            if(args_buf[CONFIG_SYNTAX_NOADAPTIVE] != 0)
+              adaptive_ceiling = 0; /* poll at fixed frequency */
+          }
+
+          {
+            _kernel_oserror *e = change_poll_rate(old_delay, pw);
+            if(e != NULL)
+              return e;
+          }
+        }
       } /* endif argc > 0 */
       else {
         /* display current setting */
@@ -714,17 +1575,65 @@ _kernel_oserror *MicoJoy_cmdhandler(const char *arg_string, int argc, int cmd_no
           printf(" -endzone");
         else
           printf(" -noendzone");
+        if(irq_timing)
+          printf(" -irqtiming");
+        else
+          printf(" -noirqtiming");
+        if(events)
+          printf(" -event");
+        else
+          printf(" -noevent");
+        if(adaptive_ceiling != 0)
+          printf(" -adaptive %u", adaptive_ceiling);
+        else
+          printf(" -noadaptive");
+        if(bg_calib)
+          printf(" -bgcalib");
+        else
+          printf(" -nobgcalib");
+        if(autocalib)
+          printf(" -autocalib");
+        else
+          printf(" -noautocalib");
+        if(predict_time != 0)
+          printf(" -predict %u", predict_time);
+        else
+          printf(" -nopredict");
+        if(auto_timeout)
+          printf(" -autotimeout");
+        else
+          printf(" -noautotimeout");
+        if(hotplug)
+          printf(" -hotplug");
+        else
+          printf(" -nohotplug");
+        if(stagger != 0)
+          printf(" -stagger %u", stagger);
+        else
+          printf(" -nostagger");
+        if(retries != 0)
+          printf(" -retry %u", retries);
+        else
+          printf(" -noretry");
+        if(robust_calib)
+          printf(" -robustcalib");
+        else
+          printf(" -norobustcalib");
+        if(warm_start)
+          printf(" -warmstart");
+        else
+          printf(" -nowarmstart");
         printf(" -tolerance %u -timeout %u -poll %u\n", tolerance, max_wait, poll_freq+1);
       }
       break;
 
     case CMD_JoystickCalib:
-      /* Syntax: *JoystickCalib <stick number> <axis> [-min <time>] [-ctr <time>] [-max <time>] [-ctrzone <interval>] [-endzone <interval>] [-smooth <interval>] */
+      /* Syntax: *JoystickCalib <stick number> <axis> [-min <time>] [-ctr <time>] [-max <time>] [-ctrzone <interval>] [-endzone <interval>] [-smooth <interval>] [-filter <type>] */
       {
         /*
-           Can have no more than 14 args - the worst case is 6 evaluated elements with identifiers (12 args), 1 EE without id (1 arg) and 1 string element (1 arg). Allow one memory word for each element, plus sufficient buffer space for evaluated element blocks, plus a bit extra for the string.
+           Can have no more than 16 args - the worst case is 6 evaluated elements with identifiers (12 args), 1 EE without id (1 arg), 1 string element (1 arg) and 1 string element with identifier (2 args). Allow one memory word for each element, plus sufficient buffer space for evaluated element blocks, plus a bit extra for the strings.
          */
-        char *args_buf[(8*4) + (7*8) + 4];
+        char *args_buf[(9*4) + (7*8) + 8];
         int joynum;
         bool change_x;
         {
@@ -734,7 +1643,7 @@ _kernel_oserror *MicoJoy_cmdhandler(const char *arg_string, int argc, int cmd_no
         }
         {
           joynum = eval_expr(args_buf[CALIB_SYNTAX_JOYNUM]);
-          if(joynum > (NUM_STICKS-1) || joynum < 0)
+          if(joynum > (num_sticks-1) || joynum < 0)
             return &bad_joy_num;
         }
         {
@@ -751,56 +1660,73 @@ _kernel_oserror *MicoJoy_cmdhandler(const char *arg_string, int argc, int cmd_no
         if(args_buf[CALIB_SYNTAX_MIN] != 0) {
           int value = eval_expr(args_buf[CALIB_SYNTAX_MIN]);
           if(change_x)
-            x_min[joynum] = value;
+            stick[joynum].x.min = value;
           else
-            y_min[joynum] = value;
+            stick[joynum].y.min = value;
         }
         if(args_buf[CALIB_SYNTAX_CTR] != 0) {
           int value = eval_expr(args_buf[CALIB_SYNTAX_CTR]);
           if(change_x)
-            x_ctr[joynum] = value;
+            stick[joynum].x.ctr = value;
           else
-            y_ctr[joynum] = value;
+            stick[joynum].y.ctr = value;
         }
         if(args_buf[CALIB_SYNTAX_MAX] != 0) {
           int value = eval_expr(args_buf[CALIB_SYNTAX_MAX]);
           if(change_x)
-            x_max[joynum] = value;
+            stick[joynum].x.max = value;
           else
-            y_max[joynum] = value;
+            stick[joynum].y.max = value;
         }
         if(args_buf[CALIB_SYNTAX_CTRZONE] != 0) {
           int value = eval_expr(args_buf[CALIB_SYNTAX_CTRZONE]);
           if(change_x)
-            x_ctr_deadz[joynum] = value;
+            stick[joynum].x.ctr_deadz = value;
           else
-            y_ctr_deadz[joynum] = value;
+            stick[joynum].y.ctr_deadz = value;
         }
         if(args_buf[CALIB_SYNTAX_ENDZONE] != 0) {
           int value = eval_expr(args_buf[CALIB_SYNTAX_ENDZONE]);
           if(change_x)
-            x_end_deadz[joynum] = value;
+            stick[joynum].x.end_deadz = value;
           else
-            y_end_deadz[joynum] = value;
+            stick[joynum].y.end_deadz = value;
         }
         if(args_buf[CALIB_SYNTAX_SMOOTH] != 0) {
           int value = eval_expr(args_buf[CALIB_SYNTAX_SMOOTH]);
            if(change_x)
-             x_smooth[joynum] = value;
+             stick[joynum].x.smooth = value;
            else
-             y_smooth[joynum] = value;
+             stick[joynum].y.smooth = value;
+        }
+        if(args_buf[CALIB_SYNTAX_FILTER] != 0) {
+          int filter = find_filter((char *)args_buf[CALIB_SYNTAX_FILTER]);
+          if(filter < 0)
+            return &error_bad_filter;
+          if(change_x)
+            stick[joynum].x.filter = filter;
+          else
+            stick[joynum].y.filter = filter;
         }
 
         /*
            Calculate correction coefficients from new calibration data
-           (x_ctr_low, x_ctr_high, x_low_scaler, x_high_scaler etc)
+           (x_coeffs, y_coeffs)
         */
         recalc_coefficients(1u << joynum);
+        reset_tracking(1u << joynum);
+        reset_filters(1u << joynum);
+        calib_valid |= (1u << joynum);
       }
       break;
 
     case CMD_JoystickReInit:
       /* Syntax: *JoystickReInit */
+      {
+        _kernel_oserror *e = stop_irq_read(pw);
+        if(e != NULL)
+          return e;
+      }
       {
         /*
            Can have no more than 1 arg, being 1 evaluated element without identifier. Allow one memory word for this element, plus sufficient buffer space for the evaluated element block.
@@ -813,12 +1739,12 @@ _kernel_oserror *MicoJoy_cmdhandler(const char *arg_string, int argc, int cmd_no
         }
         if(args_buf[REINIT_SYNTAX_JOYNUM] != 0) {
           int joynum = eval_expr(args_buf[REINIT_SYNTAX_JOYNUM]);
-          if(joynum > (NUM_STICKS-1) || joynum < 0)
+          if(joynum > (num_sticks-1) || joynum < 0)
             return &bad_joy_num;
 
-          reinit_joysticks(1u << joynum);
+          return calibrate(CALIB_GOAL_REINIT, 1u << joynum, pw);
         } else
-          reinit_joysticks(STICK_0|STICK_1);
+          return calibrate(CALIB_GOAL_REINIT, ALL_STICKS, pw);
       }
   } /* endswitch */
   return NULL;
@@ -830,6 +1756,16 @@ _kernel_oserror *pollstick_handler(_kernel_swi_regs *r, void *pw)
 {
   /* Called every 10 cs (100,000s) */
   UNUSED(r);
+
+  /* Sample the fire buttons on every tick (cheap, unlike the axes) */
+  sample_buttons();
+
+  if(adaptive_ceiling != 0) {
+    /* Ticker runs every centisecond, so skip polls whilst the sticks are at rest */
+    if(--poll_countdown > 0)
+      return NULL;
+    poll_countdown = poll_interval;
+  }
   
 #ifdef DEBUG
   xsyslog_irqmode(1);
@@ -844,6 +1780,8 @@ _kernel_oserror *pollstick_handler(_kernel_swi_regs *r, void *pw)
     if(e == NULL) {
       callback_pending = true;
       callback_free = false;
+      callback_time = read_timestamp();
+      stats.polls++;
     }
 #ifdef DEBUG
     else {
@@ -851,10 +1789,13 @@ _kernel_oserror *pollstick_handler(_kernel_swi_regs *r, void *pw)
     }
 #endif
   }
-#ifdef DEBUG
   else {
+#ifdef DEBUG
     xsyslog_logmessage(log_name, "Last CallBack to doread_veneer still pending/in progress", 1);
+#endif
+    stats.skipped++;
   }
+#ifdef DEBUG
   xsyslog_irqmode(0);
 #endif
   return NULL; /* success */
@@ -881,20 +1822,9 @@ _kernel_oserror *stoppoll_handler(_kernel_swi_regs *r, void *pw)
 #ifdef DEBUG
     xsyslog_logmessage(log_name, "No calls to Joystick_Read in last 10 seconds", 1);
 #endif
-    if(polling_stick) {
-      /* Joystick_Read not called recently - cease polling */
-     _kernel_oserror *e;
-#ifdef DEBUG
-      xsyslog_logmessage(log_name, "Removing CallEvery to pollstick_veneer", 1);
-#endif
-      e = _swix(OS_RemoveTickerEvent, _INR(0,1), pollstick_veneer, pw);
-      /* (note this SWI *is* re-entrant!) */
-      if(e == NULL)
-        polling_stick = false;
-#ifdef DEBUG
-      else
-        xsyslog_logmessage(log_name, e->errmess, 0);
-#endif
+    if(!events && calib_job.phase == CALIB_PHASE_IDLE && num_clients == 0) {
+      /* Joystick_Read not called recently - cease polling (unless clients are waiting for events, calibrating or registered) */
+      stop_polling(pw); /* (note OS_RemoveTickerEvent *is* re-entrant!) */
     }
   }
 #ifdef DEBUG
@@ -908,7 +1838,7 @@ _kernel_oserror *stoppoll_handler(_kernel_swi_regs *r, void *pw)
 _kernel_oserror *doread_handler(_kernel_swi_regs *r, void *pw)
 {
   /* Reading the joystick would take too long in an interrupt - this way we can take as long as we want, and call non-re-entrant SWIs too */
-  UNUSED(pw);
+  unsigned int wanted;
   UNUSED(r);
   
   callback_pending = false; /* nothing to remove */
@@ -917,12 +1847,151 @@ _kernel_oserror *doread_handler(_kernel_swi_regs *r, void *pw)
 #ifdef DEBUG
     xsyslog_logmessage(log_name, "Reached doread_handler on transient CallBack", 1);
 #endif
-    read_joystick(axes_mask, NULL);
+    if(calib_job.phase != CALIB_PHASE_IDLE) {
+      /* Calibrating in the background, one read per poll (polls are at least 2cs apart) */
+      if(calib_step())
+        end_calib(pw);
+      callback_free = true; /* allow another one to be added */
+      return NULL; /* success */
+    }
+
+    wanted = client_axes();
+    if(wanted == 0) {
+      /* No registered client is due for a read on this poll */
+      callback_free = true; /* allow another one to be added */
+      return NULL; /* success */
+    }
+
+    _kernel_irqs_off();
+    read_start_time = read_timestamp();
+    _kernel_irqs_on();
+    stats.delays++;
+    add_time(read_start_time - callback_time, &stats.delay_min, &stats.delay_max, &stats.delay_total);
+#ifdef STATS_HISTOGRAMS
+    add_to_histogram(read_start_time - callback_time, stats.delay_hist);
+    if(prev_read_valid)
+      add_to_histogram(read_start_time - prev_read_start_time, stats.interval_hist);
+    prev_read_start_time = read_start_time;
+    prev_read_valid = true;
+#endif
+
+    {
+      unsigned int probe = hotplug_probe(); /* (disconnected axes, if it is time to look for them) */
+      unsigned int mask = stagger_axes(axes_mask & wanted) | probe;
+
+      if(irq_timing) {
+        irq_probe = probe;
+        if(start_irq_read(mask, pw) == NULL)
+          return NULL; /* finish_handler will allow another CallBack */
+        /* (fall back on busy-waiting if timer 1 is unavailable) */
+      }
+      {
+        unsigned int new_x[MAX_STICKS], new_y[MAX_STICKS], lost, axes_lost;
+        unsigned int timed_out = read_joystick(mask, probe, &lost, &axes_lost, new_x, new_y);
+        count_read(timed_out, lost, axes_lost);
+        track_calibration(new_x, new_y);
+        record_history(new_x, new_y);
+      }
+    }
   }
   callback_free = true; /* allow another one to be added */
   return NULL; /* success */
 }
 
+/* ----------------------------------------------------------------------- */
+
+_kernel_oserror *timer_handler(_kernel_swi_regs *r, void *pw)
+{
+  /* Called on IOC timer 1 interrupt every IRQ_SAMPLE_PERIOD whilst axes are being timed (interrupts disabled) */
+  IOC *ioc = (IOC *)IOC_ADDRESS;
+  unsigned int joy, new_time, wait, interval;
+  UNUSED(r);
+
+  ioc->IRQ_A.request[0] = IOC_IRQ_A_TM1; /* clear interrupt */
+  if(!irq_sampling)
+    return NULL; /* spurious */
+
+  /* Read gameport status bytes */
+  joy = ~read_gameports(); /* now bits set indicate axes finished */
+
+  new_time = read_timer_0(ioc);
+  if(new_time > irq_start_time) { /* timer has wrapped */
+    irq_start_time += 20000;
+    irq_prev_time += 20000; /* the new time will be < 19999 */
+  }
+  wait = irq_start_time - new_time;
+  interval = irq_prev_time - new_time;
+  irq_prev_time = new_time;
+
+  /*
+     Axis bits dropped at some point since the previous sample, so take
+     the midpoint. Interrupt latency beyond the tolerance means that
+     the sample was delayed by something else.
+  */
+  irq_mask = resolve_axes(joy, wait - (interval / 2), interval <= (IRQ_SAMPLE_PERIOD + IRQ_SAMPLE_SLACK + tolerance), irq_mask, irq_new_x, irq_new_y, &irq_lost);
+
+  if(irq_mask == 0 || wait >= irq_max_wait) {
+    /* All axes finished or timed out */
+    _kernel_oserror *e;
+
+    irq_timed_out |= irq_mask;
+    if(irq_lost != 0 && irq_attempt < retries) {
+      /*
+         Samples were delayed by an interrupt - read just those axes again
+         straight away (-retry), as read_joystick does
+      */
+      irq_attempt++;
+      irq_mask = irq_lost;
+      irq_lost = 0;
+      irq_start_time = start_gameports(irq_mask);
+      irq_prev_time = irq_start_time;
+      return NULL; /* success */
+    }
+    irq_mask = irq_timed_out;
+
+    /* Hand over the timings in the foreground */
+    ioc->IRQ_A.mask[0] &= ~IOC_IRQ_A_TM1;
+    irq_sampling = false;
+
+#ifdef DEBUG
+    xsyslog_irqmode(1);
+    xsyslog_logmessage(log_name, "Adding transient CallBack to finish_veneer", 1);
+#endif
+    e = _swix(OS_AddCallBack, _INR(0,1), finish_veneer, pw);
+    if(e == NULL)
+      finish_pending = true;
+    else
+      callback_free = true; /* lose this read, but allow another */
+#ifdef DEBUG
+    xsyslog_irqmode(0);
+#endif
+  }
+  return NULL; /* success */
+}
+
+/* ----------------------------------------------------------------------- */
+
+_kernel_oserror *finish_handler(_kernel_swi_regs *r, void *pw)
+{
+  /* Pass axis timings gathered under interrupt to the smoothing stage */
+  UNUSED(r);
+
+  finish_pending = false; /* nothing to remove */
+
+#ifdef DEBUG
+  xsyslog_logmessage(log_name, "Reached finish_handler on transient CallBack", 1);
+#endif
+  irq_mask = clamp_axes(irq_mask, irq_max_wait, irq_new_x, irq_new_y);
+  irq_mask = bring_up(irq_probe, irq_mask, irq_new_x, irq_new_y);
+  store_timings(irq_new_x, irq_new_y);
+  count_read(irq_mask, lost_sticks(irq_lost), irq_lost);
+  track_calibration(irq_new_x, irq_new_y);
+  record_history(irq_new_x, irq_new_y);
+
+  callback_free = true; /* allow another read to be started */
+  return NULL; /* success */
+}
+
 
 /* ----------------------------------------------------------------------- */
 
@@ -964,6 +2033,26 @@ _kernel_oserror *MicoJoy_finalise(int fatal, int podule, void *pw)
     }
     callback_pending = false;
   }
+  {
+    /* Abandon any interrupt-driven read in progress, and release timer 1 */
+    _kernel_oserror *e = stop_irq_read(pw);
+    if(e == NULL)
+      e = release_timer(pw);
+    if(e != NULL) {
+#ifdef DEBUG
+      xsyslog_logmessage(log_name, e->errmess, 0);
+#endif
+      return e; /* fail */
+    }
+  }
+
+  if(state_block != NULL) {
+    /* Free the state block shared with clients (they were warned!) */
+    state_block->version = 0;
+    state_block->seq |= 1; /* (never consistent again) */
+    _swix(OS_Module, _IN(0)|_IN(2), 7, state_block);
+    state_block = NULL;
+  }
 
   /* Remove routine to monitor whether Joystick SWIs are being called */
   return _swix(OS_RemoveTickerEvent, _INR(0,1), stoppoll_veneer, pw);
@@ -972,624 +2061,2337 @@ _kernel_oserror *MicoJoy_finalise(int fatal, int podule, void *pw)
 /* ----------------------------------------------------------------------- */
 /*                         Private functions                               */
 
-static void recalc_coefficients(int sticks)
+static _kernel_oserror *prepare_read(unsigned int flags, void *pw)
 {
   /*
-     Calculate correction coefficients from our calibration data
-     (x_ctr_low, x_ctr_high, x_low_scaler, x_high_scaler etc)
+     Common entry to SWIs that read the joystick state - fails during
+     calibration, otherwise makes sure that the stick is being polled.
+     A read by a registered client (handle in bits 16-23 of the SWI's R0)
+     is covered by the axes it registered, whereas any other read needs
+     all the axes to be polled for a while.
   */
-  int stick_num;
-  
-#ifdef DEBUG
-  xsyslog_logmessage(log_name, "Recalculating correction coefficients", 50);
-#endif
-
-  for(stick_num = (NUM_STICKS-1); stick_num >= 0; stick_num--) {
-    if(sticks & (1u << stick_num)) {
-      {
-        unsigned int x_ctr_dz, y_ctr_dz;
-        if(ctr_zones) {
-          x_ctr_dz = x_ctr_deadz[stick_num];
-          y_ctr_dz = y_ctr_deadz[stick_num];
-        } else {
-          x_ctr_dz = 0;
-          y_ctr_dz = 0;
-        }
-        x_ctr_low[stick_num] = x_ctr[stick_num] - x_ctr_dz;
-        x_ctr_high[stick_num] = x_ctr[stick_num] + x_ctr_dz;
-#ifdef DEBUG
-        xsyslogf(log_name, 50, "centre x limits for stick %d : %u,%u", stick_num, x_ctr_low[stick_num], x_ctr_high[stick_num]);
-#endif
-        y_ctr_low[stick_num] = y_ctr[stick_num] - y_ctr_dz;
-        y_ctr_high[stick_num] = y_ctr[stick_num] + y_ctr_dz;
-#ifdef DEBUG
-       xsyslogf(log_name, 50, "centre y limits for stick %d : %u,%u", stick_num, y_ctr_low[stick_num], y_ctr_high[stick_num]);
-#endif
-      }
-      {
-        unsigned int x_end_dz, y_end_dz;
-        if(end_zones) {
-          x_end_dz = x_end_deadz[stick_num];
-          y_end_dz = y_end_deadz[stick_num];
-        } else {
-          x_end_dz = 0;
-          y_end_dz = 0;
-        }
-        safedivide(x_low_scaler[stick_num], (32768<<SCALER_FRAC_SHIFT), x_ctr_low[stick_num] - (x_min[stick_num] + x_end_dz));
-#ifdef DEBUG
-        xsyslogf(log_name, 50, "x_low_scaler for stick %d : %u/16384 (approx. %u)", stick_num, x_low_scaler[stick_num], x_low_scaler[stick_num] >> 14);
-#endif
-
-        safedivide(x_high_scaler[stick_num], (32768<<SCALER_FRAC_SHIFT), (x_max[stick_num] - x_end_dz) - x_ctr_high[stick_num]);
-#ifdef DEBUG
-        xsyslogf(log_name, 50, "x_high_scaler for stick %d : %u/16384 (approx. %u)", stick_num, x_high_scaler[stick_num], x_high_scaler[stick_num] >> 14);
-#endif
+  unsigned int handle = (flags & READ_HANDLE_MASK) >> READ_HANDLE_SHIFT;
 
-        safedivide(y_low_scaler[stick_num], (32768<<SCALER_FRAC_SHIFT), y_ctr_low[stick_num] - (y_min[stick_num] + y_end_dz));
-#ifdef DEBUG
-        xsyslogf(log_name, 50, "y_low_scaler for stick %d : %u/16384 (approx. %u)", stick_num, y_low_scaler[stick_num], y_low_scaler[stick_num] >> 14);
-#endif
+  if(calib_job.phase != CALIB_PHASE_IDLE)
+    return &error_calib_busy; /* fail */
+  if(calib_status != CALIB_NONE)
+    return &error_calib; /* fail */
 
-        safedivide(y_high_scaler[stick_num], (32768<<SCALER_FRAC_SHIFT), (y_max[stick_num] - y_end_dz) - y_ctr_high[stick_num]);
-#ifdef DEBUG
-        xsyslogf(log_name, 50, "y_high_scaler for stick %d : %u/16384 (approx. %u)", stick_num, y_high_scaler[stick_num], y_high_scaler[stick_num] >> 14);
-#endif
-      }
-    } /* endif sticks & (1u << stick_num) */
-  } /* next stick */
+  if(handle == 0)
+    swi_in_last_min = true;
+  else {
+    if(handle > MAX_CLIENTS || !client[handle-1].used)
+      return &error_bad_client; /* fail */
+  }
+  return start_polling(pw);
 }
 
 /* ----------------------------------------------------------------------- */
 
-static unsigned int read_joystick(unsigned int mask, unsigned int *lost)
+static _kernel_oserror *start_polling(void *pw)
 {
   /*
-     Read current position of joysticks
-
-     Input: Bits set in mask indicate axes to read
-     Returns: updated mask (bits set indicate axes that timed out)
+     Make sure that the stick is being polled
   */
-  unsigned int start_time;
-  unsigned int new_x[2], new_y[2];
-
+  if(!polling_stick) {
+    /* Restart polling after a period of inactivity */
+    _kernel_oserror *e;
+    int stick_num;
 #ifdef DEBUG
-  xsyslogf(log_name, 50, "read_joystick mask (axes to read): &%x", mask);
+    xsyslog_logmessage(log_name, "Joystick_Read after inactivity - registering CallEvery to pollstick_veneer", 1);
 #endif
+    sample_buttons(); /* (before pollstick_handler can do so) */
+    e = _swix(OS_CallEvery, _INR(0,2), ticker_delay(), pollstick_veneer, pw);
+    if(e != NULL)
+      return e;
+    polling_stick = true;
+#ifdef STATS_HISTOGRAMS
+    prev_read_valid = false; /* (don't count the period of inactivity as an interval) */
+#endif
+    
+    /* We must assume that all values are terribly out of date */
+    for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+      int xc = stick[stick_num].x.ctr, yc = stick[stick_num].y.ctr;
+      stick[stick_num].x.value = xc;
+      stick[stick_num].y.value = yc;
+    } /* next stick_num */
 
-  _kernel_irqs_off();
-
-  /* Write dummy byte to the gameport (set axis bits) */
-  *game_port_address = 0;
+    if(warm_start && calib_job.phase == CALIB_PHASE_IDLE && !irq_sampling)
+      warm_start_read(); /* (rather than reporting centred sticks until the first poll) */
+    else
+      publish_snapshot();
+  } /* endif !polling_stick */
 
+  return NULL; /* success */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void warm_start_read(void)
+{
+  /*
+     Read the joysticks once in the foreground as polling restarts, so that
+     the first SWI after a period of inactivity returns their real
+     positions (*JoystickConfig -warmstart). Axes that time out or whose
+     values are lost are left centred.
+  */
+  bool old_smooth = smooth;
+  int stick_num;
+
+#ifdef DEBUG
+  xsyslog_logmessage(log_name, "Warm start - reading joysticks before first poll", 50);
+#endif
+
+  _kernel_irqs_off();
+  read_start_time = read_timestamp();
+  _kernel_irqs_on();
+  /* (We ASSUME that by doing this we are restoring the entry state) */
+
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    /* No idea how the sticks are moving yet (a zero interval estimates no velocity) */
+    stick[stick_num].x.vel = 0;
+    stick[stick_num].y.vel = 0;
+    stick[stick_num].x.time = read_start_time;
+    stick[stick_num].y.time = read_start_time;
+  } /* next stick_num */
+
+  smooth = false; /* old values are too out of date to smooth towards */
+  read_joystick(axes_mask, 0, NULL, NULL, NULL, NULL); /* (publishes the snapshot, giving up by the deadline from axis_deadline) */
+  smooth = old_smooth;
+
+  reset_filters(ALL_STICKS);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static _kernel_oserror *stop_polling(void *pw)
+{
+  /*
+     Stop polling the stick, if it is being polled
+  */
+  _kernel_oserror *e;
+
+  if(!polling_stick)
+    return NULL; /* nothing to do */
+#ifdef DEBUG
+  xsyslog_logmessage(log_name, "Removing CallEvery to pollstick_veneer", 1);
+#endif
+  e = _swix(OS_RemoveTickerEvent, _INR(0,1), pollstick_veneer, pw);
+  if(e != NULL) {
+#ifdef DEBUG
+    xsyslog_logmessage(log_name, e->errmess, 0);
+#endif
+    return e; /* fail */
+  }
+  polling_stick = false;
+  return NULL; /* success */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static _kernel_oserror *change_poll_rate(unsigned int old_delay, void *pw)
+{
+  /*
+     Re-attach pollstick_veneer if polling and ticker_delay() no longer
+     returns old_delay (e.g. after reconfiguring or (de)registering a client)
+  */
+  if(ticker_delay() != old_delay && polling_stick) {
+    /* First stop polling at old frequency */
+    _kernel_oserror *e = _swix(OS_RemoveTickerEvent, _INR(0,1), pollstick_veneer, pw);
+    if(e != NULL)
+      return e;
+
+    /* Now start polling at new frequency */
+    e = _swix(OS_CallEvery, _INR(0,2), ticker_delay(), pollstick_veneer, pw);
+    if(e != NULL) {
+      polling_stick = false; /* we've buggered it up */
+      return e;
+    } /* endif e != NULL */
+  } /* endif ticker_delay() != old_delay */
+
+  return NULL; /* success */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int client_axes(void)
+{
+  /*
+     Find the axes that registered clients want read on this poll, and
+     note when each of those clients is next due
+     Returns: axes bits (all of them if no clients are registered, or an
+              unregistered program has read recently, since it may read
+              any joystick)
+  */
+  unsigned int axes = 0, now;
+  int client_num;
+
+  if(num_clients == 0)
+    return ~0u;
+
+  if(swi_in_last_min)
+    axes = axes_mask; /* (a program that never registered is reading too) */
+
+  _swix(OS_ReadMonotonicTime, _OUT(0), &now);
+  for(client_num = (MAX_CLIENTS-1); client_num >= 0; client_num--) {
+    Client *c = &client[client_num];
+    if(c->used && (int)(now - c->next_time) >= 0) {
+      axes |= c->axes;
+      c->next_time += c->interval;
+      if((int)(now - c->next_time) >= 0)
+        c->next_time = now + c->interval; /* fallen behind (polls are too far apart) */
+    }
+  } /* next client_num */
+#ifdef DEBUG
+  xsyslogf(log_name, 50, "Axes wanted by registered clients: &%x", axes);
+#endif
+  return axes;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void record_history(const unsigned int *new_x, const unsigned int *new_y)
+{
+  /*
+     Add a record of the latest poll to the history buffer
+     (overwriting the oldest record)
+  */
+  HistoryRecord *rec = &history[history_count % HISTORY_SIZE];
+  int stick_num;
+
+  _swix(OS_ReadMonotonicTime, _OUT(0), &rec->time);
+  for(stick_num = (MAX_STICKS-1); stick_num >= 0; stick_num--) {
+    /* (joysticks beyond those found are never read) */
+    rec->raw_x[stick_num] = new_x[stick_num];
+    rec->raw_y[stick_num] = new_y[stick_num];
+    rec->x_axis[stick_num] = stick[stick_num].x.value;
+    rec->y_axis[stick_num] = stick[stick_num].y.value;
+  }
+  rec->buttons = button_state; /* same layout */
+  history_count++;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void sample_buttons(void)
+{
+  /*
+     Read the fire buttons from the gameports, latching any that have been
+     pressed or released since the last sample
+     (called with interrupts disabled)
+  */
+  unsigned int buttons = 0, changed;
+  int port_num;
+
+  for(port_num = (num_ports-1); port_num >= 0; port_num--) {
+    unsigned char joy = *port_address[port_num]; /* read joystick status bits */
+    int stick_num = port_num * STICKS_PER_PORT;
+    buttons |= (stick_buttons(joy, 0) | (stick_buttons(joy, 1) << 8)) << (stick_num * 8);
+  }
+
+  changed = buttons ^ button_state;
+  button_pressed |= changed & buttons;
+  button_released |= changed & ~buttons;
+  if(changed != 0) {
+    int stick_num;
+    for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+      unsigned int down = sampled_buttons(changed & buttons, stick_num), up = sampled_buttons(changed & ~buttons, stick_num);
+      /* (add 1 to the count in bits 0-15 for button 0, and in bits 16-31 for button 1) */
+      press_count[stick_num] += (down & 1) + ((down & 2) << (PRESS_COUNT_SHIFT-1));
+      release_count[stick_num] += (up & 1) + ((up & 2) << (PRESS_COUNT_SHIFT-1));
+    } /* next stick_num */
+  }
+  button_state = buttons;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int sampled_buttons(unsigned int buttons, int stick_num)
+{
+  /* Extract one stick's fire buttons from a value laid out as button_state */
+  return (buttons >> (stick_num * 8)) & 0xff;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int read_timestamp(void)
+{
+  /*
+     Read the time in IOC timer ticks (0.5s), combining the monotonic time
+     with the count of IOC timer 0. Wraps round after about 35 minutes.
+     (must be called with interrupts disabled)
+  */
+  IOC *ioc = (IOC *)IOC_ADDRESS;
+  unsigned int cs, count;
+
+  _swix(OS_ReadMonotonicTime, _OUT(0), &cs);
+  count = read_timer_0(ioc);
+  if(ioc->IRQ_A.request[0] & IOC_IRQ_A_TM0) {
+    /* Timer 0 has wrapped but the monotonic time has not yet been incremented */
+    count = read_timer_0(ioc);
+    cs++;
+  }
+  return (cs * 20000) + (19999 - count);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void reset_stats(void)
+{
+  /* Zero the counters of the driver's activity */
+  memset(&stats, 0, sizeof(stats));
+  stats.read_min = UINT_MAX;
+  stats.delay_min = UINT_MAX;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void count_read(unsigned int timed_out, unsigned int sticks_lost, unsigned int axes_lost)
+{
+  /*
+     Update the counters at the end of a read started by doread_handler
+
+     Input: Bits set in timed_out indicate axes that timed out,
+            bits set in sticks_lost indicate sticks with lost axis values,
+            bits set in axes_lost indicate axes whose values were lost
+            (and not recovered by any re-read)
+  */
+  unsigned int now;
+
+  _kernel_irqs_off();
+  now = read_timestamp();
+  _kernel_irqs_on();
+  /* (We ASSUME that by doing this we are restoring the entry state) */
+
+  stats.reads++;
+  add_time(now - read_start_time, &stats.read_min, &stats.read_max, &stats.read_total);
+#ifdef STATS_HISTOGRAMS
+  add_to_histogram(now - read_start_time, stats.read_hist);
+#endif
+
+  {
+    int stick_num;
+    for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+      if(sticks_lost & (1u << stick_num))
+        stats.lost[stick_num]++;
+      /* (axis bits are in the same order as the counters) */
+      if(timed_out & (1u << (stick_num*2)))
+        stats.timeouts[stick_num*2]++;
+      if(timed_out & (1u << (stick_num*2+1)))
+        stats.timeouts[stick_num*2+1]++;
+      if(axes_lost & (1u << (stick_num*2)))
+        stats.axis_lost[stick_num*2]++;
+      if(axes_lost & (1u << (stick_num*2+1)))
+        stats.axis_lost[stick_num*2+1]++;
+    } /* next stick_num */
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void add_time(unsigned int time, unsigned int *t_min, unsigned int *t_max, unsigned int *t_total)
+{
+  /* Accumulate a time for the minimum, mean and maximum */
+  if(time < *t_min)
+    *t_min = time;
+  if(time > *t_max)
+    *t_max = time;
+  *t_total += time;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int mean(unsigned int total, unsigned int count)
+{
+  unsigned int quotient;
+  safedivide(quotient, total, count);
+  return quotient;
+}
+
+/* ----------------------------------------------------------------------- */
+
+#ifdef STATS_HISTOGRAMS
+static void add_to_histogram(unsigned int time, unsigned int *hist)
+{
+  /* Count a time in the log2 bucket it falls into */
+  int bucket = 0;
+  while(bucket < (STATS_BUCKETS-1) && (time >> (bucket+1)) != 0)
+    bucket++;
+  hist[bucket]++;
+}
+#endif
+
+/* ----------------------------------------------------------------------- */
+
+static bool run_bench(unsigned int interval, unsigned int duration, BenchResult *res)
+{
+  /*
+     Read the joysticks repeatedly for *JoystickBench, through the same
+     smoothing and conversion as a poll, and measure the cost and quality
+     of the reads. The reads are not published (so no events are raised),
+     and the axis state and adaptive poll interval are put back afterwards,
+     so that the run leaves no trace in the values clients see.
+
+     Input: interval is the time between the starts of reads (in cs), or 0
+            to read back to back, and duration is the length of the run
+            (in cs)
+     Returns: false if the run was stopped by the Escape key
+  */
+  unsigned int start_cs, now_cs, due_cs, start_time, end_time;
+  unsigned int saved_interval = poll_interval, saved_countdown = poll_countdown, saved_axis_time = axis_time;
+  bool escaped = false;
+  int axis;
+
+  memset(res, 0, sizeof(*res));
+  res->interval = interval;
+  res->read_min = UINT_MAX;
+  for(axis = (MAX_STICKS*2-1); axis >= 0; axis--) {
+    res->pos_min[axis] = INT_MAX;
+    res->pos_max[axis] = INT_MIN;
+  }
+
+  memcpy(bench_saved, stick, sizeof(bench_saved));
+  benchmarking = true;
+
+  /* Read number of centi-seconds since last hard reset */
+  _swix(OS_ReadMonotonicTime, _OUT(0), &start_cs);
+  _kernel_irqs_off();
+  start_time = read_timestamp();
+  _kernel_irqs_on();
+  /* (We ASSUME that by doing this we are restoring the entry state) */
+
+  now_cs = due_cs = start_cs;
+  while(now_cs - start_cs < duration && !escaped) {
+    /* (note this also works if the timer should wrap!) */
+    unsigned int lost, axes_lost, timed_out, now;
+
+    if((signed int)(now_cs - due_cs) >= 0) {
+      /* The next read is due */
+      _kernel_irqs_off();
+      read_start_time = read_timestamp();
+      _kernel_irqs_on();
+      timed_out = read_joystick(axes_mask, 0, &lost, &axes_lost, NULL, NULL); /* (smooths the values read) */
+      _kernel_irqs_off();
+      now = read_timestamp();
+      _kernel_irqs_on();
+      due_cs += interval;
+
+      res->reads++;
+      add_time(now - read_start_time, &res->read_min, &res->read_max, &res->read_total);
+      {
+        int stick_num;
+        for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+          unsigned int pos8, pos16;
+          signed int pos[2];
+          convert_position(stick_num, stick[stick_num].x.value, stick[stick_num].y.value, &pos8, &pos16);
+          pos[0] = POS16_X(pos16);
+          pos[1] = POS16_Y(pos16);
+          for(axis = stick_num*2+1; axis >= stick_num*2; axis--) {
+            /* (axis bits are in the same order as the counters) */
+            if(timed_out & (1u << axis))
+              res->timeouts[axis]++;
+            else if(axes_mask & (1u << axis)) {
+              if(pos[axis & 1] < res->pos_min[axis])
+                res->pos_min[axis] = pos[axis & 1];
+              if(pos[axis & 1] > res->pos_max[axis])
+                res->pos_max[axis] = pos[axis & 1];
+            }
+            if(axes_lost & (1u << axis))
+              res->axis_lost[axis]++;
+          } /* next axis */
+        } /* next stick_num */
+      }
+    }
+    {
+      int flags;
+      _swix(OS_ReadEscapeState, _OUT(_FLAGS), &flags);
+      escaped = (flags & _C) != 0;
+    }
+    _swix(OS_ReadMonotonicTime, _OUT(0), &now_cs);
+  } /* endwhile */
+
+  _kernel_irqs_off();
+  end_time = read_timestamp();
+  _kernel_irqs_on();
+  res->elapsed = end_time - start_time;
+
+  benchmarking = false;
+  memcpy(stick, bench_saved, sizeof(bench_saved));
+  poll_interval = saved_interval;
+  poll_countdown = saved_countdown;
+  axis_time = saved_axis_time;
+
+  return !escaped;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void show_bench(const BenchResult *res)
+{
+  /* Display one line of *JoystickBench results */
+  unsigned int lost = 0, timeouts = 0, cpu;
+  int axis;
+
+  for(axis = (MAX_STICKS*2-1); axis >= 0; axis--) {
+    lost += res->axis_lost[axis];
+    timeouts += res->timeouts[axis];
+  }
+  safedivide(cpu, res->read_total, res->elapsed / 1000); /* (in tenths of a percent) */
+
+  if(res->interval != 0)
+    printf("%8u", res->interval);
+  else
+    printf("       -"); /* back to back */
+  printf(" %7u %7u %6u %7u %3u.%u %6u %8u\n", res->reads, res->reads ? res->read_min : 0, mean(res->read_total, res->reads), res->read_max, cpu / 10, cpu % 10, lost, timeouts);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int ticker_delay(void)
+{
+  /* Delay to pass to OS_CallEvery for pollstick_veneer (in cs, minus 1) */
+  unsigned int delay;
+  int client_num;
+
+  if(adaptive_ceiling != 0)
+    return 0; /* every cs, so that any interval can be kept to (pollstick_handler skips polls as necessary) */
+
+  delay = poll_freq;
+  for(client_num = (MAX_CLIENTS-1); client_num >= 0; client_num--) {
+    /* Poll often enough for the most demanding registered client */
+    if(client[client_num].used && client[client_num].interval != 0 && client[client_num].interval-1 < delay)
+      delay = client[client_num].interval-1;
+  } /* next client_num */
+  if(delay < MIN_POLL_INTERVAL-1)
+    delay = MIN_POLL_INTERVAL-1;
+
+  return delay;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int stick_buttons(unsigned int joy, int stick_num)
+{
+  /*
+     Extract fire buttons for a joystick from the gameport status byte
+     Returns: bits set reflect buttons pushed
+  */
+  unsigned int buttons = 0;
+  if(stick_num == 0) {
+    /* return joystick A buttons */
+    if(!(joy & PC_JOY_A_B1))
+      buttons |= (1u<<0);
+    if(!(joy & PC_JOY_A_B2))
+      buttons |= (1u<<1);
+  } else {
+    /* return joystick B buttons */
+    if(!(joy & PC_JOY_B_B1))
+      buttons |= (1u<<0);
+    if(!(joy & PC_JOY_B_B2))
+      buttons |= (1u<<1);
+  }
+  return buttons;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void recalc_coefficients(int sticks)
+{
+  /*
+     Calculate correction coefficients from our calibration data
+     (x_coeffs, y_coeffs)
+  */
+  int stick_num;
+  
+#ifdef DEBUG
+  xsyslog_logmessage(log_name, "Recalculating correction coefficients", 50);
+#endif
+
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(sticks & (1u << stick_num)) {
+      unsigned int x_ctr_dz, y_ctr_dz, x_end_dz, y_end_dz;
+      if(ctr_zones) {
+        x_ctr_dz = stick[stick_num].x.ctr_deadz;
+        y_ctr_dz = stick[stick_num].y.ctr_deadz;
+      } else {
+        x_ctr_dz = 0;
+        y_ctr_dz = 0;
+      }
+      if(end_zones) {
+        x_end_dz = stick[stick_num].x.end_deadz;
+        y_end_dz = stick[stick_num].y.end_deadz;
+      } else {
+        x_end_dz = 0;
+        y_end_dz = 0;
+      }
+#ifdef DEBUG
+      xsyslogf(log_name, 50, "Coefficients for stick %d (x then y)", stick_num);
+#endif
+      calc_coefficients(&stick[stick_num].x.coeffs, stick[stick_num].x.min, stick[stick_num].x.ctr, stick[stick_num].x.max, x_ctr_dz, x_end_dz);
+      calc_coefficients(&stick[stick_num].y.coeffs, stick[stick_num].y.min, stick[stick_num].y.ctr, stick[stick_num].y.max, y_ctr_dz, y_end_dz);
+
+      /* Only do the arithmetic that these coefficients need on each poll */
+      stick[stick_num].conversion = select_conversion(&stick[stick_num].x.coeffs, &stick[stick_num].y.coeffs);
+    } /* endif sticks & (1u << stick_num) */
+  } /* next stick */
+
+  publish_snapshot(); /* convert positions using new coefficients */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void convert_position(int stick_num, unsigned int x_time, unsigned int y_time, unsigned int *pos8, unsigned int *pos16)
+{
+  /*
+     Convert axis timings to 8-bit and 16-bit joystick positions, using the
+     routines chosen by recalc_coefficients
+  */
+  const AxisCoeffs *x_coeffs = &stick[stick_num].x.coeffs, *y_coeffs = &stick[stick_num].y.coeffs;
+
+  switch(stick[stick_num].conversion) {
+    case CONVERT_NOCTRZONE:
+      *pos8 = convert_8bit_noctrzone(x_coeffs, y_coeffs, x_time, y_time);
+      *pos16 = convert_16bit_noctrzone(x_coeffs, y_coeffs, x_time, y_time);
+      break;
+
+    default:
+      *pos8 = convert_8bit(x_coeffs, y_coeffs, x_time, y_time);
+      *pos16 = convert_16bit(x_coeffs, y_coeffs, x_time, y_time);
+      break;
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static _kernel_oserror *find_gameports(void)
+{
+  /*
+     Find the addresses of the gameports set up by Plug'n'Play. The first
+     is given by PnPManager$GamesPort_Address, any others by
+     PnPManager$GamesPort1_Address, PnPManager$GamesPort2_Address etc.
+  */
+  char var_name[40], addr_buffer[10];
+  int var_num;
+
+  num_ports = 0;
+  for(var_num = 0; var_num <= MAX_PORTS && num_ports < MAX_PORTS; var_num++) {
+    unsigned int address;
+    int matched, port_num;
+
+    if(var_num == 0)
+      strcpy(var_name, "PnPManager$GamesPort_Address");
+    else
+      sprintf(var_name, "PnPManager$GamesPort%d_Address", var_num);
+
+    /*
+      Check whether Plug'n'Play properly initialised
+    */
+    if(_kernel_getenv(var_name, addr_buffer, sizeof(addr_buffer)) != NULL) {
+      if(var_num == 0)
+        return &gameport_not_found; /* fail */
+      continue;
+    }
+    matched = sscanf(addr_buffer, "&%x", &address);
+    if(matched == EOF || matched < 1) {
+      if(var_num == 0)
+        return &gameport_not_found; /* fail */
+      continue;
+    }
+
+    for(port_num = 0; port_num < num_ports; port_num++) {
+      if(port_address[port_num] == (volatile unsigned char *)address)
+        break; /* already found */
+    }
+    if(port_num == num_ports) {
+#ifdef DEBUG
+      xsyslogf(log_name, 50, "Gameport %d at &%x (%s)", num_ports, address, var_name);
+#endif
+      port_address[num_ports++] = (volatile unsigned char *)address;
+    }
+  } /* next var_num */
+
+  num_sticks = num_ports * STICKS_PER_PORT;
+  return NULL; /* success */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int read_joystick(unsigned int mask, unsigned int probe, unsigned int *lost, unsigned int *axes_lost, unsigned int *raw_x, unsigned int *raw_y)
+{
+  /*
+     Read current position of joysticks on all gameports
+
+     Input: Bits set in mask indicate axes to read
+            probe = axes of mask read by hotplug_probe(), to be brought
+            into use before their timings are smoothed (see bring_up)
+            lost (if not NULL) receives the sticks with lost axis values
+            axes_lost (if not NULL) receives the axes whose values were
+            lost, and not recovered by any re-read (-retry)
+            raw_x and raw_y (if not NULL) receive the timings before smoothing
+     Returns: updated mask (bits set indicate axes that timed out)
+  */
+  unsigned int new_x[MAX_STICKS], new_y[MAX_STICKS], wait = axis_deadline(mask);
+  int stick_num;
+
+#ifdef DEBUG
+  xsyslogf(log_name, 50, "read_joystick mask (axes to read): &%x", mask);
+#endif
+
+  /*
+     Time how long the axis bits take to drop back to 0
+     if they take 1000s or longer then we give up (not connected?)
+     (the sampling loop is in sampler.a, and samples all gameports together)
+  */
+  {
+    SampleBlock block;
+    unsigned int timed_out = 0, attempt;
+    int port_num;
+
+    for(port_num = (MAX_PORTS-1); port_num >= 0; port_num--)
+      block.port[port_num] = (port_num < num_ports) ? port_address[port_num] : NULL;
+    block.mask = mask;
+    block.max_wait = wait;
+    block.tolerance = tolerance;
+    for(stick_num = (MAX_STICKS-1); stick_num >= 0; stick_num--) {
+      block.times[stick_num*2] = UINT_MAX;
+      block.times[stick_num*2+1] = UINT_MAX;
+    }
+
+    for(attempt = 0; ; attempt++) {
+      _kernel_irqs_off();
+      block.start_time = start_gameports(block.mask);
+      _kernel_irqs_on();
+      /* (We ASSUME that by doing this we are restoring the entry state) */
+      block.lost = 0;
+
+      sample_axes(&block);
+
+      timed_out |= block.mask;
+      if(block.lost == 0 || attempt >= retries)
+        break;
+
+      /*
+         Samples were delayed by an interrupt - rather than wait for the
+         next poll, read just those axes again (they have all finished)
+      */
+#ifdef DEBUG
+      xsyslogf(log_name, 50, "Re-reading lost axes &%x", block.lost);
+#endif
+      block.mask = block.lost;
+    }
+
+    mask = timed_out;
+#ifdef DEBUG
+    if(block.start_time >= 20000)
+      xsyslog_logmessage(log_name, "(timer 0 wrapped)", 50);
+#endif
+    for(stick_num = (MAX_STICKS-1); stick_num >= 0; stick_num--) {
+      new_x[stick_num] = block.times[stick_num*2];
+      new_y[stick_num] = block.times[stick_num*2+1];
+    }
+    /* (all counts are of the outcome after any re-reads) */
+    if(axes_lost != NULL)
+      *axes_lost = block.lost;
+    if(lost != NULL)
+      *lost = lost_sticks(block.lost);
+  }
+
+#ifdef DEBUG
+  /* Those mask bits still set indicate axes that timed out */
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(mask & (PC_JOY_A_X << (stick_num*2)))
+      xsyslogf(log_name, 50, "(timed out waiting for x axis of stick %d)", stick_num);
+    if(mask & (PC_JOY_A_Y << (stick_num*2)))
+      xsyslogf(log_name, 50, "(timed out waiting for y axis of stick %d)", stick_num);
+  }
+#endif /* DEBUG */
+
+  mask = clamp_axes(mask, wait, new_x, new_y);
+  mask = bring_up(probe, mask, new_x, new_y); /* (before the new axes' values are published) */
+  store_timings(new_x, new_y);
+
+  if(raw_x != NULL && raw_y != NULL) {
+    for(stick_num = (MAX_STICKS-1); stick_num >= 0; stick_num--) {
+      raw_x[stick_num] = new_x[stick_num];
+      raw_y[stick_num] = new_y[stick_num];
+    }
+  }
+
+  return mask;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int lost_sticks(unsigned int axes_lost)
+{
+  /* Find which sticks had an axis value lost, given the axes lost */
+  unsigned int sticks_lost = 0;
+  int stick_num;
+
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(axes_lost & STICK_AXES(stick_num)) {
+#ifdef DEBUG
+      xsyslogf(log_name, 50, "Lost axis value for stick %d", stick_num);
+#endif
+      sticks_lost |= (1u << stick_num);
+    }
+  } /* next stick_num */
+  return sticks_lost;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int start_gameports(unsigned int mask)
+{
+  /*
+     Set all axis bits of those gameports with axes to read, and read the
+     time at which we did so (must be called with interrupts disabled)
+  */
+  int port_num;
+
+  /* Write dummy byte to each gameport (set axis bits) */
+  for(port_num = 0; port_num < num_ports; port_num++) {
+    if(mask & (PORT_AXES << (port_num * PORT_AXIS_SHIFT)))
+      *port_address[port_num] = 0;
+  }
+
+  /*
+    IOC Timer 0 is used for timing - ticks at 2MHz, 0.5s per tick
+    Counts down from 19999 to 0
+  */
+  return read_timer_0((IOC *)IOC_ADDRESS);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int read_gameports(void)
+{
+  /*
+     Read the status bytes of all gameports
+     Returns: axis bits laid out as axes_mask (bits set for axes still timing)
+  */
+  unsigned int joy = 0;
+  int port_num;
+
+  for(port_num = (num_ports-1); port_num >= 0; port_num--)
+    joy |= (*port_address[port_num] & PORT_AXES) << (port_num * PORT_AXIS_SHIFT);
+
+  return joy;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int axis_limit(const Axis *axis)
+{
+  /* Longest timing expected from a calibrated axis */
+  return axis->max + axis->end_deadz;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int stagger_axes(unsigned int mask)
+{
+  /*
+     Choose which of the axes in mask to read on this poll
+     (*JoystickConfig -stagger). All axes are timed at once, so a read takes
+     as long as the slowest of them. Axes calibrated to take well beyond the
+     fastest are therefore only read on every 'stagger'th poll, so that the
+     other polls finish sooner.
+  */
+  unsigned int fastest = UINT_MAX, tail;
+  int stick_num;
+
+  if(stagger == 0)
+    return mask; /* disabled */
+
+  if(++stagger_polls >= stagger) {
+    stagger_polls = 0;
+    return mask; /* time to read every axis */
+  }
+
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if((mask & (PC_JOY_A_X << (stick_num*2))) && axis_limit(&stick[stick_num].x) < fastest)
+      fastest = axis_limit(&stick[stick_num].x);
+    if((mask & (PC_JOY_A_Y << (stick_num*2))) && axis_limit(&stick[stick_num].y) < fastest)
+      fastest = axis_limit(&stick[stick_num].y);
+  } /* next stick_num */
+  if(fastest == UINT_MAX)
+    return mask; /* no axes to read */
+
+  tail = fastest + (fastest >> STAGGER_TAIL_SHIFT);
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(axis_limit(&stick[stick_num].x) > tail)
+      mask &= ~(PC_JOY_A_X << (stick_num*2));
+    if(axis_limit(&stick[stick_num].y) > tail)
+      mask &= ~(PC_JOY_A_Y << (stick_num*2));
+  } /* next stick_num */
+
+#ifdef DEBUG
+  xsyslogf(log_name, 50, "Staggered read of axes &%x", mask);
+#endif
+  return mask;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int axis_deadline(unsigned int mask)
+{
+  /*
+     Find how long to wait (in IOC timer ticks) for the axes in mask. With
+     -autotimeout this is a little beyond the largest calibrated max (plus
+     end zone) of those axes, so that a poll need not wait for the full
+     timeout when an axis is slow.
+  */
+  unsigned int limit = 0, deadline;
+  int stick_num;
+
+  if(!auto_timeout || calib_job.phase != CALIB_PHASE_IDLE || (mask & ~axes_mask) != 0)
+    return max_wait; /* disabled, or calibration or a hotplug probe needs the full range */
+
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if((mask & (PC_JOY_A_X << (stick_num*2))) && axis_limit(&stick[stick_num].x) > limit)
+      limit = axis_limit(&stick[stick_num].x);
+    if((mask & (PC_JOY_A_Y << (stick_num*2))) && axis_limit(&stick[stick_num].y) > limit)
+      limit = axis_limit(&stick[stick_num].y);
+  } /* next stick_num */
+
+  deadline = limit + (limit >> AUTO_TIMEOUT_SHIFT);
+  if(limit == 0 || deadline > max_wait)
+    return max_wait;
+
+  return deadline;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int clamp_axes(unsigned int timed_out, unsigned int wait, unsigned int *new_x, unsigned int *new_y)
+{
+  /*
+     Treat axes that had not finished by a deadline from axis_deadline()
+     as being at their calibrated max, if they were last read near it
+     Returns: updated timed_out mask (axes that timed out, not clamped)
+  */
+  unsigned int clamped = 0;
+  int stick_num;
+
+  if(wait >= max_wait)
+    return timed_out; /* waited the full timeout */
+
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if((timed_out & (PC_JOY_A_X << (stick_num*2))) && near_max(&stick[stick_num].x)) {
+      new_x[stick_num] = stick[stick_num].x.max;
+      clamped |= PC_JOY_A_X << (stick_num*2);
+    }
+    if((timed_out & (PC_JOY_A_Y << (stick_num*2))) && near_max(&stick[stick_num].y)) {
+      new_y[stick_num] = stick[stick_num].y.max;
+      clamped |= PC_JOY_A_Y << (stick_num*2);
+    }
+  } /* next stick_num */
+
+#ifdef DEBUG
+  if(timed_out != 0)
+    xsyslogf(log_name, 50, "Clamped axes &%x of &%x at deadline %u", clamped, timed_out, wait);
+#endif
+  return timed_out & ~clamped;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static bool near_max(const Axis *axis)
+{
+  /* Was an axis's previous timing close enough to its max to clamp it there? */
+  if(axis->max <= axis->ctr)
+    return false; /* (not calibrated) */
+
+  return axis->raw >= axis->max - ((axis->max - axis->ctr) >> AUTO_TIMEOUT_NEAR_SHIFT);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int resolve_axes(unsigned int joy, unsigned int wait, bool in_time, unsigned int mask, unsigned int *new_x, unsigned int *new_y, unsigned int *axes_lost)
+{
+  /*
+     Record timings for axes whose bits have dropped since the last sample
+     (equivalent of the loop body in sampler.a, for timer_handler)
+
+     Input: Bits set in joy indicate axes finished (on all gameports),
+            in_time is false if the sample was delayed by more than the
+            tolerance
+     Returns: updated mask (bits cleared for those axes dealt with)
+  */
+  int stick_num;
+
+  joy &= mask; /* mask out those bits we aren't interested in */
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(joy & STICK_AXES(stick_num)) {
+      /* axis bit is set */
+      if(in_time) {
+        if(joy & (PC_JOY_A_X << (stick_num*2)))
+          new_x[stick_num] = wait;
+        if(joy & (PC_JOY_A_Y << (stick_num*2)))
+          new_y[stick_num] = wait;
+      } else {
+        *axes_lost |= joy & STICK_AXES(stick_num);
+      }
+    }
+  } /* next stick_num */
+  return mask & ~joy; /* mask out those bits */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void store_timings(const unsigned int *new_x, const unsigned int *new_y)
+{
+  /*
+     Pass new raw axis timings through the smoothing stage
+     (UINT_MAX indicates that an axis was not read)
+  */
+#ifdef DEBUG
+  xsyslogf(log_name, 50, "Raw axis times Ax:%d Ay:%d Bx:%d By:%d", new_x[0], new_y[0], new_x[1], new_y[1]);
+#endif /* DEBUG */
+
+  {
+    int stick_num;
+    bool moving = false;
+
+    axis_time = read_start_time;
+    for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+
+      if(new_x[stick_num] != UINT_MAX) {
+        unsigned int diff, prev = stick[stick_num].x.value;
+        stick[stick_num].x.raw = new_x[stick_num];
+        absdiff(diff, stick[stick_num].x.value, new_x[stick_num]);
+        if(diff > stick[stick_num].x.smooth*2)
+          moving = true; /* beyond average jitter */
+
+        /*
+           Smooth output value
+        */
+        if(smooth && (stick[stick_num].x.smooth > 0 || stick[stick_num].x.filter == FILTER_MEDIAN)) {
+#ifdef DEBUG
+          xsyslogf(log_name, 50, "Smoothing x axis of stick %d", stick_num);
+#endif /* DEBUG */
+          stick[stick_num].x.value = filter_value(stick[stick_num].x.filter, &stick[stick_num].x.filter_state, stick[stick_num].x.value, new_x[stick_num], stick[stick_num].x.smooth);
+        }
+        else
+          stick[stick_num].x.value = new_x[stick_num];
+
+        stick[stick_num].x.vel = estimate_velocity(stick[stick_num].x.vel, prev, stick[stick_num].x.value, stick[stick_num].x.smooth*2, read_start_time - stick[stick_num].x.time);
+        stick[stick_num].x.time = read_start_time; /* (axes may be read on different polls) */
+      } /* endif new_x[stick_num] == 0 */
+
+      if(new_y[stick_num] != UINT_MAX) {
+        unsigned int diff, prev = stick[stick_num].y.value;
+        stick[stick_num].y.raw = new_y[stick_num];
+        absdiff(diff, stick[stick_num].y.value, new_y[stick_num]);
+        if(diff > stick[stick_num].y.smooth*2)
+          moving = true; /* beyond average jitter */
+
+        /*
+           Smooth output value
+        */
+        if(smooth && (stick[stick_num].y.smooth > 0 || stick[stick_num].y.filter == FILTER_MEDIAN)) {
+#ifdef DEBUG
+          xsyslogf(log_name, 50, "Smoothing y axis of stick %d", stick_num);
+#endif /* DEBUG */
+          stick[stick_num].y.value = filter_value(stick[stick_num].y.filter, &stick[stick_num].y.filter_state, stick[stick_num].y.value, new_y[stick_num], stick[stick_num].y.smooth);
+        }
+        else
+          stick[stick_num].y.value = new_y[stick_num];
+
+        stick[stick_num].y.vel = estimate_velocity(stick[stick_num].y.vel, prev, stick[stick_num].y.value, stick[stick_num].y.smooth*2, read_start_time - stick[stick_num].y.time);
+        stick[stick_num].y.time = read_start_time; /* (axes may be read on different polls) */
+      } /* endif new_y[stick_num] == 0 */
+
+    } /* next stick_num */
+
+    if(adaptive_ceiling != 0) {
+      /* Poll quickly whilst sticks are moving, and back off gradually once they stop */
+      if(moving)
+        poll_interval = MIN_POLL_INTERVAL;
+      else {
+        if(poll_interval < adaptive_ceiling)
+          poll_interval += MIN_POLL_INTERVAL;
+        if(poll_interval > adaptive_ceiling)
+          poll_interval = adaptive_ceiling; /* (an odd ceiling is not a multiple of the step) */
+      }
+      if(poll_countdown > poll_interval)
+        poll_countdown = poll_interval;
+    }
+  }
+#ifdef DEBUG
+  xsyslogf(log_name, 50, "Output A: x%u y%u, B: x%u y%u (poss smoothed)", stick[0].x.value, stick[0].y.value, stick[1].x.value, stick[1].y.value);
+#endif /* DEBUG */
+
+  publish_snapshot();
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void publish_snapshot(void)
+{
+  /*
+     Copy current axis values into the spare snapshot buffer, then make
+     it the current one. Only ever called from one place at a time (the
+     poll CallBack, or the foreground when polling is stopped).
+  */
+  unsigned int seq = snapshot_seq;
+  Snapshot *next = &snapshot[(seq + 1) & 1];
+  int stick_num;
+
+  if(benchmarking)
+    return; /* (*JoystickBench reads mustn't reach clients) */
+
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    unsigned int x_time = stick[stick_num].x.value, y_time = stick[stick_num].y.value;
+    next->x_axis[stick_num] = x_time;
+    next->y_axis[stick_num] = y_time;
+    next->x_raw[stick_num] = stick[stick_num].x.raw;
+    next->y_raw[stick_num] = stick[stick_num].y.raw;
+
+    /* Convert once per poll rather than on every Joystick_Read */
+    convert_position(stick_num, x_time, y_time, &next->pos8[stick_num], &next->pos16[stick_num]);
+    next->x_vel[stick_num] = stick[stick_num].x.vel;
+    next->y_vel[stick_num] = stick[stick_num].y.vel;
+    next->x_time[stick_num] = stick[stick_num].x.time;
+    next->y_time[stick_num] = stick[stick_num].y.time;
+  }
+  next->time = axis_time;
+  next->samples = snapshot[seq & 1].samples + 1;
+
+  snapshot_seq = seq + 1; /* switch buffers */
+  update_state_block(next);
+
+  if(events && polling_stick && calib_job.phase == CALIB_PHASE_IDLE)
+    raise_events(&snapshot[seq & 1], next);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void update_state_block(const Snapshot *snap)
+{
+  /*
+     Copy a newly published snapshot, and the current fire buttons, into
+     the state block shared with clients (if any client has asked for it)
+  */
+  volatile StateBlock *block = state_block;
+  unsigned int joy_buttons, presses[MAX_STICKS], releases[MAX_STICKS], now;
+  int stick_num;
+
+  if(block == NULL)
+    return; /* nobody is interested */
+
+  _swix(OS_ReadMonotonicTime, _OUT(0), &now);
+
+  /* Take the buttons and counters without pollstick_handler intervening */
+  _kernel_irqs_off();
+  joy_buttons = button_state;
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    presses[stick_num] = press_count[stick_num];
+    releases[stick_num] = release_count[stick_num];
+  } /* next stick_num */
+  _kernel_irqs_on();
+  /* (We ASSUME that by doing this we are restoring the entry state) */
+
+  block->seq++; /* odd - update in progress */
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    unsigned int buttons = sampled_buttons(joy_buttons, stick_num);
+    block->stick[stick_num].pos8 = snap->pos8[stick_num] | (buttons << 16);
+    block->stick[stick_num].pos16 = snap->pos16[stick_num];
+    block->stick[stick_num].buttons = buttons;
+    block->stick[stick_num].presses = presses[stick_num];
+    block->stick[stick_num].releases = releases[stick_num];
+  } /* next stick_num */
+  block->samples = snap->samples;
+  block->time = now;
+  block->seq++; /* even - update complete */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void raise_events(const Snapshot *prev, const Snapshot *next)
+{
+  /*
+     Raise an event for each stick whose position or buttons have changed
+     since the previous snapshot, so that clients need not busy-poll.
+     Button changes are found from the press and release counts, so a
+     button pressed and released again between polls is reported too (as
+     in state_block).
+  */
+  unsigned int joy_buttons, presses[MAX_STICKS], releases[MAX_STICKS];
+  int stick_num;
+
+  /* Take the buttons and counters without pollstick_handler intervening */
+  _kernel_irqs_off();
+  joy_buttons = button_state;
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    presses[stick_num] = press_count[stick_num];
+    releases[stick_num] = release_count[stick_num];
+  } /* next stick_num */
+  _kernel_irqs_on();
+  /* (We ASSUME that by doing this we are restoring the entry state) */
+
+  for(stick_num = 0; stick_num < num_sticks; stick_num++) {
+    unsigned int buttons = sampled_buttons(joy_buttons, stick_num), changed = 0;
+    unsigned int edges = (presses[stick_num] ^ stick[stick_num].event_presses) | (releases[stick_num] ^ stick[stick_num].event_releases);
+
+    /* (counts for button 0 are in bits 0-15, and for button 1 in bits 16-31) */
+    if(edges & ((1u << PRESS_COUNT_SHIFT) - 1))
+      changed |= 1;
+    if(edges >> PRESS_COUNT_SHIFT)
+      changed |= 2;
+
+    if(changed != 0 || next->pos16[stick_num] != prev->pos16[stick_num]) {
+#ifdef DEBUG
+      xsyslogf(log_name, 50, "Raising event for stick %d (buttons changed &%x)", stick_num, changed);
+#endif
+      _swix(OS_GenerateEvent, _INR(0,5), Event_User, Joystick_Read, stick_num, next->pos16[stick_num], buttons, changed);
+      stick[stick_num].event_presses = presses[stick_num];
+      stick[stick_num].event_releases = releases[stick_num];
+    }
+  } /* next stick_num */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void read_snapshot(Snapshot *copy)
+{
+  /*
+     Take a consistent copy of the current snapshot, without disabling
+     interrupts (try again if it was superseded whilst being copied)
+  */
+  unsigned int seq;
+  do {
+    seq = snapshot_seq;
+    *copy = snapshot[seq & 1];
+  } while(seq != snapshot_seq);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void predict_snapshot(Snapshot *snap)
+{
+  /*
+     Replace the positions in a copy of a snapshot with those extrapolated
+     to the current time from the axis velocities (*JoystickConfig -predict).
+     Each axis is extrapolated from when it was last read, since with
+     -stagger some axes are not read on every poll.
+  */
+  unsigned int now;
+  int stick_num;
+
+  if(predict_time == 0 || !polling_stick)
+    return; /* not predicting, or values not from regular polls */
+
+  _kernel_irqs_off();
+  now = read_timestamp();
+  _kernel_irqs_on();
+  /* (We ASSUME that by doing this we are restoring the entry state) */
+
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    unsigned int x_time, y_time;
+
+    if(snap->x_vel[stick_num] == 0 && snap->y_vel[stick_num] == 0)
+      continue; /* at rest */
+
+    x_time = extrapolate(snap->x_axis[stick_num], snap->x_vel[stick_num], now - snap->x_time[stick_num]);
+    y_time = extrapolate(snap->y_axis[stick_num], snap->y_vel[stick_num], now - snap->y_time[stick_num]);
+
+    convert_position(stick_num, x_time, y_time, &snap->pos8[stick_num], &snap->pos16[stick_num]);
+  } /* next stick_num */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static signed int estimate_velocity(signed int old_vel, unsigned int prev_value, unsigned int new_value, unsigned int jitter, unsigned int interval)
+{
+  /*
+     Update the average rate of change of an axis value, given the change
+     over the interval (in IOC timer ticks) since the previous read.
+     Changes within the jitter range are taken as no movement.
+  */
+  signed int change = (signed int)new_value - (signed int)prev_value, vel;
+
+  if((change <= (signed int)jitter && change >= -(signed int)jitter) || interval == 0 || interval > MAX_PREDICT_TIME * 20000)
+    vel = 0; /* at rest, or reads too far apart to judge */
+  else if(change >= (signed int)(interval >> 4))
+    vel = MAX_VELOCITY; /* (change/interval beyond 1/16 - also avoids overflow below) */
+  else if(change <= -(signed int)(interval >> 4))
+    vel = -MAX_VELOCITY;
+  else
+    vel = (change * (1<<VELOCITY_SHIFT)) / (signed int)interval; /* (|change| < 25000) */
+
+  return (old_vel + vel) / 2;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int extrapolate(unsigned int value, signed int vel, unsigned int elapsed)
+{
+  /*
+     Extrapolate an axis timing by its velocity over elapsed IOC timer
+     ticks. Both are bounded (by MAX_VELOCITY and -predict), so the product
+     fits in 32 bits even for a corrupt velocity.
+  */
+  signed int time;
+
+  if(vel > MAX_VELOCITY)
+    vel = MAX_VELOCITY;
+  else if(vel < -MAX_VELOCITY)
+    vel = -MAX_VELOCITY;
+  if(elapsed > predict_time * 20000)
+    elapsed = predict_time * 20000; /* limit the guesswork */
+
+  time = (signed int)value + (vel * (signed int)(elapsed >> 4)) / (1<<(VELOCITY_SHIFT-4));
+  if(time < 0)
+    time = 0;
+  return (unsigned int)time;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static _kernel_oserror *claim_timer(void *pw)
+{
   /*
-    IOC Timer 0 is used for timing - ticks at 2MHz, 0.5s per tick
-    Counts down from 19999 to 0
+     Claim the IOC timer 1 device vector for timer_handler, which keeps it
+     for as long as axes are timed from interrupts (*JoystickConfig -irqtiming)
+  */
+  if(!timer_claimed) {
+    _kernel_oserror *e;
+#ifdef DEBUG
+    xsyslog_logmessage(log_name, "Claiming timer 1 device vector", 1);
+#endif
+    e = _swix(OS_ClaimDeviceVector, _INR(0,2), TIMER_1_DEVICE, timer_veneer, pw);
+    if(e != NULL)
+      return e; /* fail */
+    timer_claimed = true;
+  }
+  return NULL; /* success */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static _kernel_oserror *release_timer(void *pw)
+{
+  /*
+     Release timer 1 for use by other software (any interrupt-driven read
+     must have been stopped first, see stop_irq_read)
+  */
+  if(timer_claimed) {
+    _kernel_oserror *e;
+#ifdef DEBUG
+    xsyslog_logmessage(log_name, "Releasing timer 1 device vector", 1);
+#endif
+    e = _swix(OS_ReleaseDeviceVector, _INR(0,2), TIMER_1_DEVICE, timer_veneer, pw);
+    if(e != NULL)
+      return e; /* fail */
+    timer_claimed = false;
+  }
+  return NULL; /* success */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static _kernel_oserror *start_irq_read(unsigned int mask, void *pw)
+{
+  /*
+     Begin timing axes from IOC timer 1 interrupts instead of busy-waiting.
+     All gameports are sampled together by timer_handler, which re-reads
+     lost axes (-retry) and adds a CallBack to finish_veneer once all axes
+     have finished or timed out.
+
+     Input: Bits set in mask indicate axes to read
   */
+  IOC *ioc = (IOC *)IOC_ADDRESS;
+  int stick_num;
+
   {
-    IOC *ioc =  (IOC *)IOC_ADDRESS;
-    ioc->timer_0.latch[0] = 0; /* make value appear on latch */
-    start_time = (unsigned int)(ioc->timer_0.low[0] + (ioc->timer_0.high[0] << 8));
+    _kernel_oserror *e = claim_timer(pw); /* (normally claimed already) */
+    if(e != NULL)
+      return e; /* fail */
+  }
+
+  for(stick_num = (MAX_STICKS-1); stick_num >= 0; stick_num--) {
+    irq_new_x[stick_num] = UINT_MAX;
+    irq_new_y[stick_num] = UINT_MAX;
   }
+  irq_mask = mask;
+  irq_lost = 0;
+  irq_timed_out = 0;
+  irq_attempt = 0;
+  irq_max_wait = axis_deadline(mask);
+
+  _kernel_irqs_off();
+  irq_start_time = start_gameports(mask);
+  irq_prev_time = irq_start_time;
+
+  /* Timer 1 reloads from its latch each time it reaches 0 */
+  ioc->timer_1.low[0] = (IRQ_SAMPLE_PERIOD-1) & 0xff;
+  ioc->timer_1.high[0] = (IRQ_SAMPLE_PERIOD-1) >> 8;
+  ioc->timer_1.go[0] = 0;
 
+  ioc->IRQ_A.request[0] = IOC_IRQ_A_TM1; /* clear any stale interrupt */
+  ioc->IRQ_A.mask[0] |= IOC_IRQ_A_TM1;
+  irq_sampling = true;
   _kernel_irqs_on();
   /* (We ASSUME that by doing this we are restoring the entry state) */
 
-  new_x[0] = UINT_MAX; new_y[0] = UINT_MAX; new_x[1] = UINT_MAX; new_y[1] = UINT_MAX;
+  return NULL; /* success */
+}
+
+/* ----------------------------------------------------------------------- */
 
+static _kernel_oserror *stop_irq_read(void *pw)
+{
   /*
-     Time how long the axis bits take to drop back to 0
-     if they take 1000s or longer then we give up (not connected?)   */
-  {
-    int prev_time = start_time, wait = 0;
-    unsigned int sticks_lost = 0;
+     Abandon any interrupt-driven axis timing in progress (timer 1 stays
+     claimed, see release_timer)
+  */
+  if(timer_claimed) {
+    IOC *ioc = (IOC *)IOC_ADDRESS;
+
+    _kernel_irqs_off();
+    ioc->IRQ_A.mask[0] &= ~IOC_IRQ_A_TM1;
+    if(irq_sampling) {
+      irq_sampling = false;
+      callback_free = true; /* allow another read to be started */
+    }
+    _kernel_irqs_on();
+    /* (We ASSUME that by doing this we are restoring the entry state) */
+  }
+  if(finish_pending) {
+    _kernel_oserror *e;
+#ifdef DEBUG
+    xsyslog_logmessage(log_name, "Removing outstanding CallBack to finish_veneer", 1);
+#endif
+    e = _swix(OS_RemoveCallBack, _INR(0,1), finish_veneer, pw);
+    if(e != NULL)
+      return e; /* fail */
+    finish_pending = false;
+    callback_free = true; /* allow another read to be started */
+  }
+  return NULL; /* success */
+}
 
-    while (mask != 0 && wait < max_wait) {
-      unsigned int interval, new_time, joy;
+/* ----------------------------------------------------------------------- */
 
-      _kernel_irqs_off();
+static _kernel_oserror *calibrate(int goal, unsigned int sticks, void *pw)
+{
+  /*
+     Start a calibration job, and either see it through in the foreground
+     or leave doread_handler to step it once per poll (*JoystickConfig -bgcalib)
+  */
+  if(calib_job.phase != CALIB_PHASE_IDLE)
+    return &error_calib_busy; /* fail */
 
-      /* Read gameport status byte */
-      joy = ~(*game_port_address); /* now bits set indicate axes finished */
+  if(goal == CALIB_GOAL_TOP_RIGHT)
+    calib_status |= CALIB_TOP_RIGHT;
+  if(goal == CALIB_GOAL_BOTTOM_LEFT)
+    calib_status |= CALIB_BOTTOM_LEFT;
 
-      /* Read IOC Timer 0 */
-      {
-        IOC *ioc =  (IOC *)IOC_ADDRESS;
-        ioc->timer_0.latch[0] = 0; /* make value appear on latch */
-        new_time = (unsigned int)(ioc->timer_0.low[0] + (ioc->timer_0.high[0] << 8));
-      }
-      _kernel_irqs_on();
-      /* (We ASSUME that by doing this we are restoring the entry state) */
+  start_calib(goal, sticks);
 
-      if(new_time > start_time) { /* timer has wrapped */
-        start_time += 20000;
-        prev_time += 20000; /* the new time will be < 19999 */
-      }
-      wait = start_time - new_time;
+  if(bg_calib) {
+    bool was_polling = polling_stick;
+    if(start_polling(pw) == NULL) {
+      calib_job.started_polling = !was_polling;
+      return NULL; /* success - calibration continues in the background */
+    }
+    /* (fall back on calibrating in the foreground if polling can't start) */
+  }
+  run_calib();
+  return end_calib(pw);
+}
 
+/* ----------------------------------------------------------------------- */
 
-      /* Check for interrupt or something disrupting loop */
-      interval = prev_time - new_time;
-      prev_time = new_time;
+static _kernel_oserror *end_calib(void *pw)
+{
+  /*
+     Tidy up polling after a calibration job has finished. A background
+     job that had to start polling stops it again unless something else
+     now needs it. Calibrating the corners stops polling until both are
+     done, so restart it if registered clients are relying on it.
+  */
+  if(calib_job.started_polling) {
+    calib_job.started_polling = false;
+    if(!swi_in_last_min && !events && num_clients == 0)
+      return stop_polling(pw); /* nobody has asked for it since */
+  }
+  if(calib_status == CALIB_NONE && num_clients > 0)
+    return start_polling(pw);
+
+  return NULL; /* success */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void run_calib(void)
+{
+  /*
+     Step the calibration job in progress to completion, in the foreground
+  */
+  unsigned int lasttime;
 
-      joy &= mask; /* mask out those bits we aren't interested in */
-      if (joy & PC_JOY_A_X) {
-        /* axis bit is set */
-        if(interval <= tolerance) {
-          new_x[0] = wait;
-//#ifdef DEBUG
-//          xsyslogf(log_name, 50, "Got Ax - interval was %d", interval);
-//#endif /* DEBUG */
-        } else {
 #ifdef DEBUG
-          xsyslogf(log_name, 50, "Lost Ax - interval was %d", interval);
-#endif /* DEBUG */
-          sticks_lost |= STICK_0;
-        }
-        mask &= ~PC_JOY_A_X; /* mask out that bit */
-      }
-      if (joy & PC_JOY_A_Y) {
-        /* axis bit is set */
-        if(interval <= tolerance) {
-          new_y[0] = wait;
-//#ifdef DEBUG
-//          xsyslogf(log_name, 50, "Got Ay - interval was %d", interval);
-//#endif /* DEBUG */
-        } else {
+  _swix(Hourglass_On, 0);
+#endif
+  /* Read number of centi-seconds since last hard reset */
+  _swix(OS_ReadMonotonicTime, _OUT(0), &lasttime);
+
+  while(!calib_step()) {
+    /*
+       We enforce a little delay here (1cs), in order to allow the capacitors to 'cool down' (otherwise calibration conditions are not comparable to actual operation)
+    */
+    unsigned int newtime;
+    _kernel_oserror *e;
+    do {
+      /* Read number of centi-seconds since last hard reset */
+      e = _swix(OS_ReadMonotonicTime, _OUT(0), &newtime);
+    } while(newtime == lasttime && e == NULL);
+    /* (note this also works if the timer should wrap!) */
+    lasttime = newtime;
+  }
 #ifdef DEBUG
-          xsyslogf(log_name, 50, "Lost Ay - interval was %d", interval);
-#endif /* DEBUG */
-          sticks_lost |= STICK_0;
-        }
-        mask &= ~PC_JOY_A_Y; /* mask out that bit */
-      }
-      if (joy & PC_JOY_B_X) {
-        /* axis bit is set */
-        if(interval <= tolerance) {
-          new_x[1] = wait;
-//#ifdef DEBUG
-//          xsyslogf(log_name, 50, "Got Bx - interval was %d", interval);
-//#endif /* DEBUG */
-        } else {
+  _swix(Hourglass_Off, 0);
+#endif
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void start_calib(int goal, unsigned int sticks)
+{
+  /*
+     Set up a calibration job. Re-initialising first finds which axes are
+     connected and how much they jitter, whereas the other goals go
+     straight to averaging the current stick position.
+  */
 #ifdef DEBUG
-          xsyslogf(log_name, 50, "Lost Bx - interval was %d", interval);
-#endif /* DEBUG */
-          sticks_lost |= STICK_1;
+  xsyslogf(log_name, 50, "Starting calibration goal %d for joysticks '%u'", goal, sticks);
+#endif
+  calib_job.goal = goal;
+  calib_job.sticks = sticks;
+  calib_job.reads = 0;
+  calib_job.robust = robust_calib;
+  calib_job.started_polling = false;
+  calib_job.runs = robust_calib ? ROBUST_TEST_RUNS : NUM_TEST_RUNS; /* (fewer reads needed if outliers are rejected) */
+
+  if(goal == CALIB_GOAL_REINIT) {
+    int stick_num;
+    for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+      if(sticks & (1u << stick_num)) {
+        stick[stick_num].x.value = 800;
+        stick[stick_num].y.value = 800; /* in case axes time out */
+
+        stick[stick_num].x.smooth = 0;
+        stick[stick_num].y.smooth = 0;
+      } /* endif sticks & (1u << stick_num) */
+    } /* next stick_num */
+
+    /* We'll have raw values if you don't mind! */
+    calib_job.old_smooth = smooth;smooth = false;
+
+    calib_job.read_axes = 0;
+    for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+      if(sticks & (1u << stick_num))
+        calib_job.read_axes |= STICK_AXES(stick_num);
+    }
+
+    calib_job.new_mask = 0; /* start with presumption that nothing is connected */
+    calib_job.test = (calib_job.runs-1);
+    calib_job.phase = CALIB_PHASE_DETECT;
+  } else {
+    start_averaging();
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void start_averaging(void)
+{
+  /*
+     Move the calibration job on to finding the average stick position and
+     the maximum recorded deviation from this value, once sticks have settled
+  */
+  int stick_num;
+  unsigned int sticks = calib_job.sticks;
+
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(sticks & (1u << stick_num)) {
+      calib_job.x_tot[stick_num] = 0;
+      calib_job.y_tot[stick_num] = 0; /* initialise accumulators for average */
+      calib_job.x_jit_min[stick_num] = MAX_AXIS_WAIT_TIME;
+      calib_job.y_jit_min[stick_num] = MAX_AXIS_WAIT_TIME; /* start implausibly high */
+      calib_job.x_jit_max[stick_num] = 0;
+      calib_job.y_jit_max[stick_num] = 0; /* start implausibly low */
+      calib_job.last_x[stick_num] = UINT_MAX;
+    }
+  }
+
+  calib_job.read_axes = 0;
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(sticks & (1u << stick_num))
+      calib_job.read_axes |= STICK_AXES(stick_num);
+  }
+  calib_job.read_axes &= axes_mask; /* only those not pre-marked as consistently timing out */
+#ifdef DEBUG
+  xsyslogf(log_name, 50, "Axes to be read: &%x", calib_job.read_axes);
+  xsyslog_logmessage(log_name, "Waiting for sticks to settle...", 50);
+#endif
+
+  calib_job.go_go_go = CALIB_SETTLE_RUNS; /* max loops to wait for all sticks to settle */
+  calib_job.test = (calib_job.runs-1);
+  calib_job.phase = CALIB_PHASE_SETTLE;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static bool calib_step(void)
+{
+  /*
+     Make one read of the joysticks for the calibration job in progress
+     (reads must be at least 1cs apart)
+     Returns: true if the job has finished
+  */
+  unsigned int sticks = calib_job.sticks;
+  int stick_num;
+
+  calib_job.reads++;
+
+  switch(calib_job.phase) {
+    case CALIB_PHASE_DETECT:
+      /*
+        Find standard deviation from average x,y and limits of jitter
+      */
+
+      /* Note those axes that didn't time out (bits clear) */
+      calib_job.new_mask |= ~read_joystick(calib_job.read_axes, 0, NULL, NULL, NULL, NULL);
+
+      for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+        if(sticks & (1u << stick_num)) {
+#ifdef DEBUG
+          xsyslogf(log_name, 50, "test %d : stick[%d].x.value = %u stick[%d].y.value = %u\n", calib_job.test, stick_num, stick[stick_num].x.value, stick_num, stick[stick_num].y.value);
+#endif
+
+          if(calib_job.test < (calib_job.runs-1)) {
+            unsigned int x_diff, y_diff;
+            absdiff(x_diff, calib_job.last_x[stick_num], stick[stick_num].x.value);
+            if(x_diff > stick[stick_num].x.smooth)
+              stick[stick_num].x.smooth = x_diff;
+            absdiff(y_diff, calib_job.last_y[stick_num], stick[stick_num].y.value);
+            if(y_diff > stick[stick_num].y.smooth)
+              stick[stick_num].y.smooth = y_diff;
+            calib_job.x_samples[stick_num][(calib_job.runs-2) - calib_job.test] = x_diff;
+            calib_job.y_samples[stick_num][(calib_job.runs-2) - calib_job.test] = y_diff;
+#ifdef DEBUG
+            xsyslogf(log_name, 50, "x diff:%d y_diff:%d\n", x_diff, y_diff);
+#endif
+
+          }
+          calib_job.last_x[stick_num] = stick[stick_num].x.value;
+          calib_job.last_y[stick_num] = stick[stick_num].y.value;
+
+        } /* endif sticks & (1u << stick_num) */
+      } /* next stick_num */
+
+      if(--calib_job.test < 0) {
+        unsigned int stick_mask = calib_job.read_axes;
+
+        /* In future, mask out those axes that consistently timed out */
+        axes_mask = (axes_mask & ~stick_mask) | (calib_job.new_mask & stick_mask);
+#ifdef DEBUG
+        xsyslogf(log_name, 50, "Axes to be read in future: &%x", axes_mask);
+#endif
+
+        if(calib_job.robust) {
+          /* Smoothing range covers the differences, bar any outliers */
+          for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+            if(sticks & (1u << stick_num)) {
+              robust_estimate(calib_job.x_samples[stick_num], calib_job.runs-1, NULL, NULL, &stick[stick_num].x.smooth);
+              robust_estimate(calib_job.y_samples[stick_num], calib_job.runs-1, NULL, NULL, &stick[stick_num].y.smooth);
+            }
+          } /* next stick_num */
         }
-        mask &= ~PC_JOY_B_X; /* mask out that bit */
+
+        /*
+           Re-calibrate stick at centre, having enabled any smoothing
+        */
+        smooth = calib_job.old_smooth;
+        start_averaging();
       }
-      if (joy & PC_JOY_B_Y) {
-        /* axis bit is set */
-        if(interval <= tolerance) {
-          new_y[1] = wait;
-//#ifdef DEBUG
-//          xsyslogf(log_name, 50, "Got By - interval was %d", interval);
-//#endif /* DEBUG */
+      return false; /* not finished */
+
+    case CALIB_PHASE_SETTLE:
+      {
+        unsigned int lost, sticks_within_range = 0;
+        read_joystick(calib_job.read_axes, 0, &lost, NULL, NULL, NULL);
+
+#ifdef DEBUG
+        xsyslogf(log_name, 50, "sticks with lost axis values: %u", lost);
+        xsyslogf(log_name, 50, "loops until give up waiting for values to settle: %d", calib_job.go_go_go);
+#endif
+
+        for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+          if(sticks & (1u << stick_num)) {
+            /* We wait for stick to settle in new position (polling may have been disabled, so early values may be invalid) */
+            if(calib_job.last_x[stick_num] != UINT_MAX && !(lost & (1u << stick_num))) {
+              unsigned int diff;
+              absdiff(diff, calib_job.last_x[stick_num], stick[stick_num].x.value);
+              if(diff <= stick[stick_num].x.smooth*2) {
+                unsigned int diff;
+                absdiff(diff, calib_job.last_y[stick_num], stick[stick_num].y.value);
+                if(diff <= stick[stick_num].y.smooth*2) {
+                  /* within range of previous position */
+                  sticks_within_range |= (1u << stick_num); /* this stick has settled */
+                }
+              }
+            }
+#ifdef DEBUG
+            else {
+              xsyslogf(log_name, 50, "Skipping settle checks - first run or else readings lost for stick %d", stick_num);
+            }
+#endif
+            calib_job.last_x[stick_num] = stick[stick_num].x.value;
+            calib_job.last_y[stick_num] = stick[stick_num].y.value;
+          } /* endif sticks & (1u << stick_num) */
+        } /* next stick_num */
+
+        if(sticks_within_range == sticks) {
+          calib_job.phase = CALIB_PHASE_AVERAGE; /* now we can start the real calculations */
+#ifdef DEBUG
+          xsyslog_logmessage(log_name, "Values have settled satisfactorily", 50);
+#endif
         } else {
+          if(--calib_job.go_go_go == 0) {
+            calib_job.phase = CALIB_PHASE_AVERAGE; /* can't wait forever! */
 #ifdef DEBUG
-          xsyslogf(log_name, 50, "Lost By - interval was %d", interval);
-#endif /* DEBUG */
-          sticks_lost |= STICK_1;
+            xsyslog_logmessage(log_name, "Giving up on waiting for values to settle!", 50);
+#endif
+          }
         }
-        mask &= ~PC_JOY_B_Y; /* mask out that bit */
       }
-    } /* endwhile */
+      return false; /* not finished */
 
-    if(lost != NULL)
-      *lost = sticks_lost;
-  }
+    case CALIB_PHASE_AVERAGE:
+      read_joystick(calib_job.read_axes, 0, NULL, NULL, NULL, NULL);
 
+      for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+        if(sticks & (1u << stick_num)) {
+          /* Ongoing calculation of average value */
+          calib_job.x_tot[stick_num] += stick[stick_num].x.value;
+          calib_job.y_tot[stick_num] += stick[stick_num].y.value;
+          calib_job.x_samples[stick_num][(calib_job.runs-1) - calib_job.test] = stick[stick_num].x.value;
+          calib_job.y_samples[stick_num][(calib_job.runs-1) - calib_job.test] = stick[stick_num].y.value;
 #ifdef DEBUG
-  xsyslogf(log_name, 50, "Raw axis times Ax:%d Ay:%d Bx:%d By:%d", new_x[0], new_y[0], new_x[1], new_y[1]);
-  
-  /* Those mask bits still set indicate axes that timed out */
-  if(mask & PC_JOY_A_X)
-    xsyslog_logmessage(log_name, "(timed out waiting for Ax)", 50);
-  if(mask & PC_JOY_A_Y)
-    xsyslog_logmessage(log_name, "(timed out waiting for Ay)", 50);
-  if(mask & PC_JOY_B_X)
-    xsyslog_logmessage(log_name, "(timed out waiting for Bx)", 50);
-  if(mask & PC_JOY_B_Y)
-    xsyslog_logmessage(log_name, "(timed out waiting for By)", 50);
-
-  if(start_time >= 20000)
-    xsyslog_logmessage(log_name, "(timer 0 wrapped)", 50);
-#endif /* DEBUG */
+          xsyslogf(log_name, 50, "test %d : stick[%d].x.value = %u stick[%d].y.value = %u\n", calib_job.test, stick_num, stick[stick_num].x.value, stick_num, stick[stick_num].y.value);
+#endif
+          /* update maxima and minima */
+          update_min_max(stick[stick_num].x.value, &calib_job.x_jit_min[stick_num], &calib_job.x_jit_max[stick_num]);
+          update_min_max(stick[stick_num].y.value, &calib_job.y_jit_min[stick_num], &calib_job.y_jit_max[stick_num]);
+        } /* endif sticks & (1u << stick_num) */
+      } /* next stick_num */
 
-  {
-    int stick_num;
-    for(stick_num = (NUM_STICKS-1); stick_num >= 0; stick_num--) {
+      if(--calib_job.test >= 0)
+        return false; /* not finished */
 
-      if(new_x[stick_num] != UINT_MAX) {
+      finish_calib();
+      return true; /* finished */
+
+    default:
+      return true; /* no job in progress */
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void finish_calib(void)
+{
+  /*
+     Store the results of the calibration job according to its goal
+  */
+  unsigned int x_av[MAX_STICKS], y_av[MAX_STICKS], x_jitdist[MAX_STICKS], y_jitdist[MAX_STICKS];
+  unsigned int sticks = calib_job.sticks;
+  int stick_num, bias;
+
+  switch(calib_job.goal) {
+    case CALIB_GOAL_TOP_RIGHT:
+      bias = X_BIAS_MIN|Y_BIAS_MAX;
+      break;
+    case CALIB_GOAL_BOTTOM_LEFT:
+      bias = X_BIAS_MAX|Y_BIAS_MIN;
+      break;
+    default:
+      bias = 0;
+      break;
+  }
 
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(sticks & (1u << stick_num)) {
+      if(calib_job.robust) {
+        /* Average and jitter limits of those values that aren't outliers */
+        robust_estimate(calib_job.x_samples[stick_num], calib_job.runs, &x_av[stick_num], &calib_job.x_jit_min[stick_num], &calib_job.x_jit_max[stick_num]);
+        robust_estimate(calib_job.y_samples[stick_num], calib_job.runs, &y_av[stick_num], &calib_job.y_jit_min[stick_num], &calib_job.y_jit_max[stick_num]);
+      } else {
+        /* Finish off average calculations */
+        x_av[stick_num] = calib_job.x_tot[stick_num] / calib_job.runs;
+        y_av[stick_num] = calib_job.y_tot[stick_num] / calib_job.runs;
+      }
+#ifdef DEBUG
+      xsyslogf(log_name, 50, "average x[%d]:%d average y[%d]:%d\n",stick_num, x_av[stick_num], stick_num, y_av[stick_num]);
+#endif
+      {
         /*
-           Smooth output value
-        */
-        if(smooth && x_smooth[stick_num] > 0) {
+           Deadzone should cover all recorded values,
+           whilst being symmetric around the average centre value
+         */
+        int min,max;
+        min = x_av[stick_num] - calib_job.x_jit_min[stick_num];
+        max = calib_job.x_jit_max[stick_num] - x_av[stick_num];
+        if((min > max || (bias & X_BIAS_MIN)) && !(bias & X_BIAS_MAX)) {
+          /* max > min or biased towards min, and not biased towards max */
+          x_jitdist[stick_num] = (unsigned int)min;
+        } else {
+          /* biased towards max, or max >= min and not biased towards min */
+          x_jitdist[stick_num] = (unsigned int)max;
+        }
 #ifdef DEBUG
-          xsyslogf(log_name, 50, "Smoothing x axis of stick %d", stick_num);
-#endif /* DEBUG */
-          x_axis[stick_num] = smooth_value(x_axis[stick_num], new_x[stick_num], x_smooth[stick_num]);
+        xsyslogf(log_name, 50, "x deadzone for stick %d : %u (min = %u, max = %u)", stick_num, x_jitdist[stick_num], calib_job.x_jit_min[stick_num], calib_job.x_jit_max[stick_num]);
+#endif
+
+        min = y_av[stick_num] - calib_job.y_jit_min[stick_num];
+        max = calib_job.y_jit_max[stick_num] - y_av[stick_num];
+        if((min > max || (bias & Y_BIAS_MIN)) && !(bias & Y_BIAS_MAX)) {
+          /* max > min or biased towards min, and not biased towards max */
+          y_jitdist[stick_num] = (unsigned int)min;
+        } else {
+          /* biased towards max, or max >= min and not biased towards min */
+          y_jitdist[stick_num] = (unsigned int)max;
         }
-        else
-          x_axis[stick_num] = new_x[stick_num];
-      } /* endif new_x[stick_num] == 0 */
+#ifdef DEBUG
+        xsyslogf(log_name, 50, "y deadzone for stick %d : %u (min = %u, max = %u)", stick_num, y_jitdist[stick_num], calib_job.y_jit_min[stick_num], calib_job.y_jit_max[stick_num]);
+#endif
+      }
 
-      if(new_y[stick_num] != UINT_MAX) {
+      switch(calib_job.goal) {
+        case CALIB_GOAL_REINIT:
+          /* Stick was at centre */
+          stick[stick_num].x.ctr = x_av[stick_num];
+          stick[stick_num].y.ctr = y_av[stick_num];
+          stick[stick_num].x.ctr_deadz = x_jitdist[stick_num];
+          stick[stick_num].y.ctr_deadz = y_jitdist[stick_num];
 
-        /*
-           Smooth output value
-        */
-        if(smooth && y_smooth[stick_num] > 0) {
+          /*
+            Can't be sure of axis limits prior to calibration, so guess
+          */
+          stick[stick_num].x.min = 0;
+          stick[stick_num].y.min = 0;
+          stick[stick_num].x.max = stick[stick_num].x.ctr*2;
+          stick[stick_num].y.max = stick[stick_num].y.ctr*2;
 #ifdef DEBUG
-          xsyslogf(log_name, 50, "Smoothing y axis of stick %d", stick_num);
-#endif /* DEBUG */
-          y_axis[stick_num] = smooth_value(y_axis[stick_num], new_y[stick_num], y_smooth[stick_num]);
+          xsyslogf(log_name, 50, "Guessing x,y limits for stick %d : %u,%u", stick_num, stick[stick_num].x.max, stick[stick_num].y.max);
+#endif
+          break;
+
+        case CALIB_GOAL_TOP_RIGHT:
+          stick[stick_num].x.max = x_av[stick_num];
+          stick[stick_num].y.min = y_av[stick_num];
+          break;
+
+        case CALIB_GOAL_BOTTOM_LEFT:
+          stick[stick_num].x.min = x_av[stick_num];
+          stick[stick_num].y.max = y_av[stick_num];
+          break;
+      }
+
+      if(calib_job.goal != CALIB_GOAL_REINIT) {
+        if(calib_status == (CALIB_TOP_RIGHT|CALIB_BOTTOM_LEFT)) {
+          /* End zones must cover the jitter at both ends */
+          if(x_jitdist[stick_num] > stick[stick_num].x.end_deadz)
+            stick[stick_num].x.end_deadz = x_jitdist[stick_num];
+
+          if(y_jitdist[stick_num] > stick[stick_num].y.end_deadz)
+            stick[stick_num].y.end_deadz = y_jitdist[stick_num];
+        } else {
+          stick[stick_num].x.end_deadz = x_jitdist[stick_num];
+          stick[stick_num].y.end_deadz = y_jitdist[stick_num];
         }
-        else
-          y_axis[stick_num] = new_y[stick_num];
-      } /* endif new_y[stick_num] == 0 */
+      }
+    } /* endif sticks & (1u << stick_num) */
+  } /* next stick_num */
 
+  if(calib_job.goal == CALIB_GOAL_REINIT) {
+    /* Only joysticks with axes found have real calibration values */
+    for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+      if(sticks & (1u << stick_num)) {
+        if(calib_job.read_axes & STICK_AXES(stick_num))
+          calib_valid |= (1u << stick_num);
+        else
+          calib_valid &= ~(1u << stick_num);
+      }
     } /* next stick_num */
+    hotplug_track &= ~sticks; /* properly calibrated now */
   }
-#ifdef DEBUG
-  xsyslogf(log_name, 50, "Output A: x%u y%u, B: x%u y%u (poss smoothed)", x_axis[0], y_axis[0], x_axis[1], y_axis[1]);
-#endif /* DEBUG */
 
-  return mask;
+  calib_job.phase = CALIB_PHASE_IDLE;
+  reset_tracking(sticks);
+  reset_filters(sticks);
+
+  if(calib_job.goal == CALIB_GOAL_REINIT || calib_status == (CALIB_TOP_RIGHT|CALIB_BOTTOM_LEFT)) {
+    /*
+       Calculate correction coefficients from our calibration data
+       (x_coeffs, y_coeffs)
+    */
+    recalc_coefficients(sticks);
+    if(calib_job.goal != CALIB_GOAL_REINIT)
+      calib_status = CALIB_NONE; /* calibration complete */
+  }
 }
 
 /* ----------------------------------------------------------------------- */
 
-static unsigned int smooth_value(unsigned int prev_value, unsigned int new_value, unsigned int stddev)
+static unsigned int calib_reads_left(void)
 {
-  if((new_value >= (prev_value - stddev)) && (new_value <= (prev_value + stddev))) {
-  /* very likely to be jitter - smooth it lots */
-#ifdef DEBUG
-    xsyslogf(log_name, 50, "much smoothing of value %u", new_value);
-#endif /* DEBUG */
-    return ((prev_value * 3) + new_value) / 4;
-  }
-
-  if((new_value >= (prev_value - (stddev*2))) && (new_value <= (prev_value + (stddev*2)))) {
-    /* near average jitter - smooth it rather less */
-#ifdef DEBUG
-    xsyslogf(log_name, 50, "moderate smoothing of value %u", new_value);
-#endif /* DEBUG */
-    return (prev_value + new_value) / 2;
-  }
-
-  if((new_value >= (prev_value - (stddev*4))) && (new_value <= (prev_value + (stddev*4)))) {
-    /* even further away from average jitter - smooth it slightly */
-#ifdef DEBUG
-    xsyslogf(log_name, 50, "slight smoothing of value %u", new_value);
-#endif /* DEBUG */
-    return ((new_value * 3) + prev_value) / 4;
-
-  } else {
-    /* miles from jitter bounds - use new value verbatim */
-#ifdef DEBUG
-    xsyslogf(log_name, 50, "taking new value %u verbatim", new_value);
-#endif /* DEBUG */
-    return new_value;
+  /* Maximum number of reads still to do for the calibration job in progress */
+  switch(calib_job.phase) {
+    case CALIB_PHASE_DETECT:
+      return (calib_job.test + 1) + CALIB_SETTLE_RUNS + calib_job.runs;
+    case CALIB_PHASE_SETTLE:
+      return calib_job.go_go_go + calib_job.runs;
+    case CALIB_PHASE_AVERAGE:
+      return calib_job.test + 1;
+    default:
+      return 0;
   }
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void reinit_joysticks(unsigned int sticks)
+static void track_calibration(const unsigned int *new_x, const unsigned int *new_y)
 {
   /*
-    Find standard deviation from average x,y and limits of jitter
+     Adjust calibration values to follow drift, given the latest poll
+     (*JoystickConfig -autocalib). Coefficients are only recalculated if a
+     value moves by more than the jitter range.
   */
-  unsigned int last_x[NUM_STICKS], last_y[NUM_STICKS];
-  bool old_s;
+  unsigned int track = autocalib ? ALL_STICKS : hotplug_track, changed = 0;
+  bool window_end;
+  int stick_num;
 
-#ifdef DEBUG
-  xsyslogf(log_name, 50, "Initialising joysticks '%u'", sticks);
-  _swix(Hourglass_On, 0);
-#endif
-  {
-    int stick_num;
-    for(stick_num = (NUM_STICKS-1); stick_num >= 0; stick_num--) {
-      if(sticks & (1u << stick_num)) {
-        x_axis[stick_num] = 800;
-        y_axis[stick_num] = 800; /* in case axes time out */
+  if(track == 0 || calib_status != CALIB_NONE)
+    return; /* disabled, or part way through calibration */
 
-        x_smooth[stick_num] = 0;
-        y_smooth[stick_num] = 0;
-      } /* endif sticks & (1u << stick_num) */
-    } /* next stick_num */
-  }
-  
-  /* We'll have raw values if you don't mind! */
-  old_s = smooth;smooth = false;
-  
-  {
-    unsigned int new_mask = 0;  /* start with presumption that nothing is connected */
-    unsigned int stick_mask, lasttime;
-    int test;
-    
-    if(sticks & STICK_0)
-      stick_mask = PC_JOY_A_X | PC_JOY_A_Y;
-    else
-      stick_mask = 0;
-    if(sticks & STICK_1)
-      stick_mask |= PC_JOY_B_X | PC_JOY_B_Y;
-
-    /* Read number of centi-seconds since last hard reset */
-    _swix(OS_ReadMonotonicTime, _OUT(0), &lasttime);
- 
-    for(test = (NUM_TEST_RUNS-1); test >= 0; test--) {
-      int stick_num;
-      
-      /* Note those axes that didn't time out (bits clear) */
-      new_mask |= ~read_joystick(stick_mask, NULL);
- 
-      for(stick_num = (NUM_STICKS-1); stick_num >= 0; stick_num--) {
-        if(sticks & (1u << stick_num)) {
-#ifdef DEBUG
-          xsyslogf(log_name, 50, "test %d : x_axis[%d] = %u y_axis[%d] = %u\n", test, stick_num, x_axis[stick_num], stick_num, y_axis[stick_num]);
-#endif
+  window_end = (++autocal_polls >= AUTOCAL_WINDOW);
+  if(window_end)
+    autocal_polls = 0;
 
-          if(test < (NUM_TEST_RUNS-1)) {
-            unsigned int x_diff, y_diff;
-            absdiff(x_diff, last_x[stick_num], x_axis[stick_num]);
-            if(x_diff > x_smooth[stick_num])
-              x_smooth[stick_num] = x_diff;
-            absdiff(y_diff, last_y[stick_num], y_axis[stick_num]);
-            if(y_diff > y_smooth[stick_num])
-              y_smooth[stick_num] = y_diff;
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(!(track & (1u << stick_num)))
+      continue;
+    if(new_x[stick_num] != UINT_MAX) {
+      if(track_axis(&stick[stick_num].x, window_end))
+        changed |= (1u << stick_num);
+    }
+    if(new_y[stick_num] != UINT_MAX) {
+      if(track_axis(&stick[stick_num].y, window_end))
+        changed |= (1u << stick_num);
+    }
+  } /* next stick_num */
+
+  if(changed != 0) {
 #ifdef DEBUG
-            xsyslogf(log_name, 50, "x diff:%d y_diff:%d\n", x_diff, y_diff);
+    xsyslogf(log_name, 50, "Calibration values have drifted for sticks '%u'", changed);
 #endif
+    recalc_coefficients(changed);
+  }
+}
 
-          }
-          last_x[stick_num] = x_axis[stick_num];
-          last_y[stick_num] = y_axis[stick_num];
-          
-        } /* endif sticks & (1u << stick_num) */
-      } /* next stick_num */
+/* ----------------------------------------------------------------------- */
 
-      {
-        /*
-           We enforce a little delay here (1cs), in order to allow the capacitors to 'cool down' (otherwise calibration conditions are not comparable to actual operation)
-        */
-        unsigned int newtime;
-        _kernel_oserror *e;
-        do {
-          /* Read number of centi-seconds since last hard reset */
-          e = _swix(OS_ReadMonotonicTime, _OUT(0), &newtime);
-        } while(newtime == lasttime && e == NULL);
-        /* (note this also works if the timer should wrap!) */
-        lasttime = newtime;
+static bool track_axis(Axis *axis, bool window_end)
+{
+  /*
+     Follow drift of one axis' limits and centre, given its latest
+     (smoothed) timing. Limits are widened as soon as the stick goes beyond
+     them, but only narrowed at the end of a window in which the stick was
+     pushed most of the way there.
+     Returns: true if a calibration value was changed
+  */
+  AxisTrack *track = &axis->track;
+  unsigned int value = axis->value, jitter = axis->smooth * 2, near_ctr;
+  bool changed = false;
+
+  if(value < track->seen_min)
+    track->seen_min = value;
+  if(value > track->seen_max)
+    track->seen_max = value;
+
+  if(value + jitter < axis->min) {
+    axis->min = value;
+    changed = true;
+  }
+  if(value > axis->max + jitter) {
+    axis->max = value;
+    changed = true;
+  }
+
+  /*
+     Update the centre estimate whilst the stick is near the centre. The
+     window must be wider than the jitter needed to move the centre, or
+     the estimate could never get far enough away.
+  */
+  near_ctr = (axis->ctr_deadz > axis->smooth ? axis->ctr_deadz : axis->smooth) * 4;
+  if(near_ctr > 0) {
+    unsigned int diff;
+    absdiff(diff, value, axis->ctr);
+    if(diff <= near_ctr) {
+      signed int step = (signed int)((value << AUTOCAL_FRAC_SHIFT) - track->ctr_est);
+      unsigned int new_ctr;
+
+      track->ctr_est += step / (1 << AUTOCAL_CTR_SHIFT);
+      new_ctr = track->ctr_est >> AUTOCAL_FRAC_SHIFT;
+      absdiff(diff, new_ctr, axis->ctr);
+      if(diff > jitter) {
+        axis->ctr = new_ctr;
+        changed = true;
       }
-    } /* next test */
+    }
+  }
 
-    /* In future, mask out those axes that consistently timed out */
-    axes_mask = (axes_mask & ~stick_mask) | (new_mask & stick_mask);
-#ifdef DEBUG
-    xsyslogf(log_name, 50, "Axes to be read in future: &%x", axes_mask);
-#endif
+  if(window_end) {
+    /* (the centre may have been tracked beyond a limit, so guard the subtractions) */
+    if(axis->ctr > axis->min && track->seen_min > axis->min + jitter && track->seen_min < axis->min + (axis->ctr - axis->min) / 4) {
+      /* Stick was pushed near this end, but no longer reaches the limit */
+      axis->min = track->seen_min;
+      changed = true;
+    }
+    if(axis->max > axis->ctr && track->seen_max + jitter < axis->max && track->seen_max > axis->max - (axis->max - axis->ctr) / 4) {
+      axis->max = track->seen_max;
+      changed = true;
+    }
+    track->seen_min = UINT_MAX;
+    track->seen_max = 0; /* start a new window */
   }
+  return changed;
+}
+
+/* ----------------------------------------------------------------------- */
 
+static void reset_tracking(unsigned int sticks)
+{
   /*
-     Re-calibrate stick at centre, having enabled any smoothing
+     Start following drift afresh from the current calibration values
   */
-  smooth = old_s;
-  get_av_stick_pos(sticks, x_ctr, y_ctr, x_ctr_deadz, y_ctr_deadz, 0);
+  int stick_num;
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(sticks & (1u << stick_num)) {
+      stick[stick_num].x.track.seen_min = UINT_MAX;
+      stick[stick_num].x.track.seen_max = 0;
+      stick[stick_num].x.track.ctr_est = stick[stick_num].x.ctr << AUTOCAL_FRAC_SHIFT;
+      stick[stick_num].y.track.seen_min = UINT_MAX;
+      stick[stick_num].y.track.seen_max = 0;
+      stick[stick_num].y.track.ctr_est = stick[stick_num].y.ctr << AUTOCAL_FRAC_SHIFT;
+    }
+  } /* next stick_num */
+  autocal_polls = 0;
+}
+
+/* ----------------------------------------------------------------------- */
 
+static void reset_filters(unsigned int sticks)
+{
   /*
-    Can't be sure of axis limits prior to calibration, so guess
+     Start filtering afresh from the current axis values
   */
-  {
-    int stick;
-    for(stick=(NUM_STICKS-1); stick >= 0; stick--) {
-      if(sticks & (1u << stick)) {
-        x_min[stick] = 0;
-        y_min[stick] = 0;
-        x_max[stick] = x_ctr[stick]*2;
-        y_max[stick] = y_ctr[stick]*2;
-#ifdef DEBUG
-        xsyslogf(log_name, 50, "Guessing x,y limits for stick %d : %u,%u", stick, x_max[stick], y_max[stick]);
-#endif
-      } /* endif sticks & (1u << stick_num) */
+  int stick_num;
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(sticks & (1u << stick_num)) {
+      reset_filter(&stick[stick_num].x.filter_state, stick[stick_num].x.value);
+      reset_filter(&stick[stick_num].y.filter_state, stick[stick_num].y.value);
     }
-  }
+  } /* next stick_num */
+}
+
+/* ----------------------------------------------------------------------- */
 
+static unsigned int hotplug_probe(void)
+{
   /*
-     Calculate correction coefficients from our calibration data
-     (x_ctr_low, x_ctr_high, x_low_scaler, x_high_scaler etc)
+     Decide whether this poll should also read the disconnected axes
+     (*JoystickConfig -hotplug)
+     Returns: bits set for axes to probe, or 0
   */
-  recalc_coefficients(sticks);
+  if(!hotplug || ++hotplug_polls < HOTPLUG_INTERVAL)
+    return 0; /* disabled, or not yet time to look */
 
-#ifdef DEBUG
-  _swix(Hourglass_Off, 0);
-#endif
+  hotplug_polls = 0;
+  return ((1u << (num_sticks*2)) - 1) & ~axes_mask;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void get_av_stick_pos(unsigned int sticks, unsigned int *x_array, unsigned int *y_array, unsigned int *x_jitdist, unsigned int *y_jitdist, int bias)
+static unsigned int bring_up(unsigned int probe, unsigned int timed_out, const unsigned int *new_x, const unsigned int *new_y)
 {
   /*
-    Returns the average stick position and the maximum recorded deviation from this value
+     Start using any axes found by a hotplug probe, without waiting for
+     *JoystickReInit. Joysticks with saved or previously measured
+     calibration values keep them, others are centred on their first
+     reading. Either way self-calibration then refines their values.
+     Called before the timings are smoothed, so that the first values
+     published for the new axes are filtered and converted afresh.
+
+     Input: probe = axes read by hotplug_probe(), timed_out = axes that
+            timed out (including those of probe still disconnected)
+     Returns: timed_out, less the probed axes
   */
-  unsigned int x_tot[NUM_STICKS], y_tot[NUM_STICKS];
-  unsigned int x_jit_max[NUM_STICKS], x_jit_min[NUM_STICKS], y_jit_max[NUM_STICKS], y_jit_min[NUM_STICKS];
-  unsigned int last_x[NUM_STICKS], last_y[NUM_STICKS];
+  unsigned int found = probe & ~timed_out, sticks = 0;
+  int stick_num;
 
-#ifdef DEBUG
-  _swix(Hourglass_On, 0);
-#endif
-  {
-    int stick_num;
-    for(stick_num = (NUM_STICKS-1); stick_num >= 0; stick_num--) {
-      if(sticks & (1u << stick_num)) {
-        x_tot[stick_num] = 0;
-        y_tot[stick_num] = 0; /* initialise accumulators for average */
-        x_jit_min[stick_num] = MAX_AXIS_WAIT_TIME;
-        y_jit_min[stick_num] = MAX_AXIS_WAIT_TIME; /* start implausibly high */
-        x_jit_max[stick_num] = 0;
-        y_jit_max[stick_num] = 0; /* start implausibly low */
-        last_x[stick_num] = UINT_MAX;
-      }
-    }
-  }
+  if(found == 0)
+    return timed_out & ~probe; /* nothing plugged in (not counted as timeouts) */
 
+  axes_mask |= found;
 #ifdef DEBUG
-  xsyslog_logmessage(log_name, "Waiting for sticks to settle...", 50);
+  xsyslogf(log_name, 50, "Hotplug probe found axes &%x - axes to read now &%x", found, axes_mask);
 #endif
-  {
-    int test;
-    unsigned int lasttime, read_axes;
-    int go_go_go = 8; /* max loops to wait for all sticks to settle */
 
-    if(sticks & STICK_0)
-      read_axes = PC_JOY_A_X | PC_JOY_A_Y;
-    else
-      read_axes = 0;
-    if(sticks & STICK_1)
-      read_axes |= PC_JOY_B_X | PC_JOY_B_Y;
-    read_axes &= axes_mask; /* only those not pre-marked as consistently timing out */
+  for(stick_num = (num_sticks-1); stick_num >= 0; stick_num--) {
+    if(!(found & STICK_AXES(stick_num)))
+      continue;
+
+    sticks |= (1u << stick_num);
+    /* Start smoothing from the first reading, not from the value left when the stick went */
+    if(new_x[stick_num] != UINT_MAX) {
+      stick[stick_num].x.value = new_x[stick_num];
+      stick[stick_num].x.vel = 0;
+    }
+    if(new_y[stick_num] != UINT_MAX) {
+      stick[stick_num].y.value = new_y[stick_num];
+      stick[stick_num].y.vel = 0;
+    }
+    if(!(calib_valid & (1u << stick_num))) {
+      /* Never calibrated - assume it is at rest, and guess the limits as *JoystickReInit does */
+      Axis *axis[2];
+      const unsigned int *value[2];
+      int axis_num;
+
+      axis[0] = &stick[stick_num].x; value[0] = &new_x[stick_num];
+      axis[1] = &stick[stick_num].y; value[1] = &new_y[stick_num];
+      for(axis_num = 0; axis_num < 2; axis_num++) {
+        if(*value[axis_num] == UINT_MAX)
+          continue; /* this axis not (yet) found */
+        axis[axis_num]->ctr = *value[axis_num];
+        axis[axis_num]->min = 0;
+        axis[axis_num]->max = *value[axis_num] * 2;
+        axis[axis_num]->ctr_deadz = HOTPLUG_JITTER;
+        axis[axis_num]->end_deadz = HOTPLUG_JITTER;
+        axis[axis_num]->smooth = HOTPLUG_JITTER;
+      }
 #ifdef DEBUG
-    xsyslogf(log_name, 50, "Axes to be read: &%x", read_axes);
+      xsyslogf(log_name, 50, "Guessing calibration for hotplugged stick %d centred at %u,%u", stick_num, stick[stick_num].x.ctr, stick[stick_num].y.ctr);
 #endif
+    }
+  } /* next stick_num */
 
-    /* Read number of centi-seconds since last hard reset */
-    _swix(OS_ReadMonotonicTime, _OUT(0), &lasttime);
-   
-    test = (NUM_TEST_RUNS-1);
-    while(test >= 0) {
-      int stick_num;
-      unsigned int lost, sticks_within_range = 0;
-      read_joystick(read_axes, &lost);
+  recalc_coefficients(sticks);
+  reset_tracking(sticks);
+  reset_filters(sticks);
+  calib_valid |= sticks;
+  hotplug_track |= sticks; /* refine the values whilst in use */
 
-#ifdef DEBUG
-      if(go_go_go > 0) {
-        xsyslogf(log_name, 50, "sticks with lost axis values: %u", lost);
-        xsyslogf(log_name, 50, "loops until give up waiting for values to settle: %d",go_go_go);
-      }
-#endif
+  return timed_out & ~probe;
+}
 
-      for(stick_num = (NUM_STICKS-1); stick_num >= 0; stick_num--) {
-        if(sticks & (1u << stick_num)) {
-          if(go_go_go == 0) {
-            /* Ongoing calculation of average value */
-            x_tot[stick_num] += x_axis[stick_num];
-            y_tot[stick_num] += y_axis[stick_num];
-#ifdef DEBUG
-            xsyslogf(log_name, 50, "test %d : x_axis[%d] = %u y_axis[%d] = %u\n", test, stick_num, x_axis[stick_num], stick_num, y_axis[stick_num]);
-#endif
-            /* update maxima and minima */
-            update_min_max(x_axis, x_jit_min, x_jit_max, stick_num);
-            update_min_max(y_axis, y_jit_min, y_jit_max, stick_num);
+/* ----------------------------------------------------------------------- */
+
+static unsigned int load_calib(const char *file_name)
+{
+  /*
+     Load calibration values for each gameport from a file saved by
+     *JoystickSave
+     Returns: bits set for joysticks on gameports with a record in the file
+  */
+  CalibRecord records[CALIB_FILE_MAX_RECORDS];
+  int num_records = read_calib_file(file_name, records), rec_num, port_num;
+  unsigned int loaded = 0;
+
+  for(port_num = 0; port_num < num_ports; port_num++) {
+    for(rec_num = 0; rec_num < num_records; rec_num++) {
+      const CalibRecord *rec = &records[rec_num];
+      int shift = port_num * PORT_AXIS_SHIFT, first = port_num * STICKS_PER_PORT, stick_num;
+
+      if(rec->port != (unsigned int)port_address[port_num])
+        continue; /* for a different gameport */
 
-          } else {
-            /* We wait for stick to settle in new position (polling may have been disabled, so early values may be invalid) */
-            if(last_x[stick_num] != UINT_MAX && !(lost & (1u << stick_num))) {
-              unsigned int diff;
-              absdiff(diff, last_x[stick_num], x_axis[stick_num]);
-              if(diff <= x_smooth[stick_num]*2) {
-                unsigned int diff;
-                absdiff(diff, last_y[stick_num], y_axis[stick_num]);
-                if(diff <= y_smooth[stick_num]*2) {
-                  /* within range of previous position */
-                  sticks_within_range |= (1u << stick_num); /* this stick has settled */
-                }
-              }
-            }
 #ifdef DEBUG
-            else {
-              xsyslogf(log_name, 50, "Skipping settle checks - first run or else readings lost for stick %d", stick_num);
-            }
+      xsyslogf(log_name, 50, "Loading calibration for gameport %d from record %d of %s", port_num, rec_num, file_name);
 #endif
-            last_x[stick_num] = x_axis[stick_num];
-            last_y[stick_num] = y_axis[stick_num];
-          } /* endif go_go_go == 0 */
-        } /* endif sticks & (1u << stick_num) */
+      axes_mask = (axes_mask & ~(PORT_AXES << shift)) | ((rec->axes & PORT_AXES) << shift);
+      for(stick_num = (STICKS_PER_PORT-1); stick_num >= 0; stick_num--) {
+        axis_from_record(&stick[first+stick_num].x, &rec->x[stick_num]);
+        axis_from_record(&stick[first+stick_num].y, &rec->y[stick_num]);
+        loaded |= (1u << (first+stick_num));
+        if(rec->axes & ((PC_JOY_A_X | PC_JOY_A_Y) << (stick_num*2)))
+          calib_valid |= (1u << (first+stick_num)); /* (was connected when saved) */
       } /* next stick_num */
-      if(go_go_go > 0) {
-        if(sticks_within_range == sticks) {
-          go_go_go = 0; /* now we can start the real calculations */
-#ifdef DEBUG
-          xsyslog_logmessage(log_name, "Values have settled satisfactorily", 50);
-#endif
-        } else {
-          go_go_go -= 1; /* can't wait forever! */
-#ifdef DEBUG
-          if(go_go_go == 0)
-            xsyslog_logmessage(log_name, "Giving up on waiting for values to settle!", 50);
-#endif
-        }
-      } else {
-        if(go_go_go == 0)
-          test--; /* only start counting when values have settled */
-      }
+      break;
+    } /* next rec_num */
+  } /* next port_num */
 
-      {
-        /*
-           We enforce a little delay here (1cs), in order to allow the capacitors to 'cool down' (otherwise calibration conditions are not comparible to actual operation)
-        */
-        unsigned int newtime;
-        _kernel_oserror *e;
-        do {
-          /* Read number of centi-seconds since last hard reset */
-          e = _swix(OS_ReadMonotonicTime, _OUT(0), &newtime);
-        } while(newtime == lasttime && e == NULL);
-        /* (note this also works if the timer should wrap!) */
-        lasttime = newtime;
-      }
-    } /* endwhile test >= 0 */
+  if(loaded != 0) {
+    recalc_coefficients(loaded);
+    reset_tracking(loaded);
+    reset_filters(loaded);
   }
-  {
-    int stick_num;
-    for(stick_num = (NUM_STICKS-1); stick_num >= 0; stick_num--) {
-      if(sticks & (1u << stick_num)) {
-        /* Finish off average calculations */
-        x_array[stick_num] = x_tot[stick_num] / NUM_TEST_RUNS;
-        y_array[stick_num] = y_tot[stick_num] / NUM_TEST_RUNS;
-#ifdef DEBUG
-        xsyslogf(log_name, 50, "average x[%d]:%d average y[%d]:%d\n",stick_num, x_array[stick_num], stick_num, y_array[stick_num]);
-#endif
-        {
-          /*
-             Deadzone should cover all recorded values,
-             whilst being symmetric around the average centre value
-           */
-          int min,max;
-          min = x_array[stick_num] - x_jit_min[stick_num];
-          max = x_jit_max[stick_num] - x_array[stick_num];
-          if((min > max || (bias & X_BIAS_MIN)) && !(bias & X_BIAS_MAX)) {
-            /* max > min or biased towards min, and not biased towards max */
-            x_jitdist[stick_num] = (unsigned int)min;
-          } else {
-            /* biased towards max, or max >= min and not biased towards min */
-            x_jitdist[stick_num] = (unsigned int)max;
-          }
-#ifdef DEBUG
-          xsyslogf(log_name, 50, "x deadzone for stick %d : %u (min = %u, max = %u)", stick_num, x_jitdist[stick_num], x_jit_min[stick_num], x_jit_max[stick_num]);
-#endif
-  
-          min = y_array[stick_num] - y_jit_min[stick_num];
-          max = y_jit_max[stick_num] - y_array[stick_num];
-          if((min > max || (bias & Y_BIAS_MIN)) && !(bias & Y_BIAS_MAX)) {
-            /* max > min or biased towards min, and not biased towards max */
-            y_jitdist[stick_num] = (unsigned int)min;
-          } else {
-            /* biased towards max, or max >= min and not biased towards min */
-            y_jitdist[stick_num] = (unsigned int)max;
-          }
+  return loaded;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static _kernel_oserror *save_calib(const char *file_name)
+{
+  /*
+     Save the current calibration values for each gameport, keeping any
+     records for other gameports already in the file
+  */
+  CalibRecord records[CALIB_FILE_MAX_RECORDS];
+  CalibFileHeader header;
+  int num_records = read_calib_file(file_name, records), rec_num, port_num;
+  FILE *f;
+
+  if(calib_job.phase != CALIB_PHASE_IDLE)
+    return &error_calib_busy; /* fail */
+
+  for(port_num = 0; port_num < num_ports; port_num++) {
+    CalibRecord *rec;
+    int first = port_num * STICKS_PER_PORT, stick_num;
+
+    for(rec_num = 0; rec_num < num_records; rec_num++) {
+      if(records[rec_num].port == (unsigned int)port_address[port_num])
+        break; /* replace existing record */
+    }
+    if(rec_num == CALIB_FILE_MAX_RECORDS) {
+      /* File is full - discard the oldest record */
+      memmove(&records[0], &records[1], sizeof(records[0]) * (CALIB_FILE_MAX_RECORDS-1));
+      rec_num = CALIB_FILE_MAX_RECORDS-1;
+    }
+    if(rec_num == num_records)
+      num_records++;
+
 #ifdef DEBUG
-          xsyslogf(log_name, 50, "y deadzone for stick %d : %u (min = %u, max = %u)", stick_num, y_jitdist[stick_num], y_jit_min[stick_num], y_jit_max[stick_num]);
+    xsyslogf(log_name, 50, "Saving calibration for gameport %d as record %d of %s", port_num, rec_num, file_name);
 #endif
-        }
-      }
+    rec = &records[rec_num];
+    rec->port = (unsigned int)port_address[port_num];
+    rec->axes = (axes_mask >> (port_num * PORT_AXIS_SHIFT)) & PORT_AXES;
+    for(stick_num = (STICKS_PER_PORT-1); stick_num >= 0; stick_num--) {
+      axis_to_record(&stick[first+stick_num].x, &rec->x[stick_num]);
+      axis_to_record(&stick[first+stick_num].y, &rec->y[stick_num]);
     } /* next stick_num */
+  } /* next port_num */
+
+  header.magic = CALIB_FILE_MAGIC;
+  header.version = CALIB_FILE_VERSION;
+  header.num_records = num_records;
+
+  f = fopen(file_name, "wb");
+  if(f == NULL)
+    return &error_save_failed; /* fail */
+  if(fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(records, sizeof(records[0]), num_records, f) != num_records) {
+    fclose(f);
+    return &error_save_failed; /* fail */
+  }
+  if(fclose(f) != 0)
+    return &error_save_failed; /* fail */
+
+  /* Set file type to Data */
+  return _swix(OS_File, _INR(0,2), 18, file_name, 0xffd);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void axis_from_record(Axis *axis, const AxisRecord *rec)
+{
+  axis->min = rec->min;
+  axis->ctr = rec->ctr;
+  axis->max = rec->max;
+  axis->ctr_deadz = rec->ctr_deadz;
+  axis->end_deadz = rec->end_deadz;
+  axis->smooth = rec->smooth;
+  axis->filter = rec->filter;
+
+  axis->value = axis->ctr; /* until the stick is read */
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void axis_to_record(const Axis *axis, AxisRecord *rec)
+{
+  rec->min = axis->min;
+  rec->ctr = axis->ctr;
+  rec->max = axis->max;
+  rec->ctr_deadz = axis->ctr_deadz;
+  rec->end_deadz = axis->end_deadz;
+  rec->smooth = axis->smooth;
+  rec->filter = axis->filter;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int read_calib_file(const char *file_name, CalibRecord *records)
+{
+  /*
+     Read the records from a calibration file (which may not exist),
+     skipping any with values that could not have been saved
+     Returns: number of records read into the CALIB_FILE_MAX_RECORDS array
+  */
+  CalibFileHeader header;
+  int num_records = 0, rec_num, num_valid = 0;
+  FILE *f = fopen(file_name, "rb");
+
+  if(f == NULL)
+    return 0; /* no file */
+
+  if(fread(&header, sizeof(header), 1, f) == 1 && header.magic == CALIB_FILE_MAGIC && header.version == CALIB_FILE_VERSION) {
+    num_records = header.num_records;
+    if(num_records > CALIB_FILE_MAX_RECORDS)
+      num_records = CALIB_FILE_MAX_RECORDS;
+    num_records = fread(records, sizeof(records[0]), num_records, f);
+  }
+#ifdef DEBUG
+  else {
+    xsyslogf(log_name, 50, "%s is not a calibration file", file_name);
   }
+#endif
+  fclose(f);
 
+  for(rec_num = 0; rec_num < num_records; rec_num++) {
+    if(valid_record(&records[rec_num])) {
+      if(num_valid != rec_num)
+        records[num_valid] = records[rec_num];
+      num_valid++;
+    }
 #ifdef DEBUG
-  _swix(Hourglass_Off, 0);
+    else {
+      xsyslogf(log_name, 50, "Skipping corrupt record %d of %s", rec_num, file_name);
+    }
 #endif
+  } /* next rec_num */
+  return num_valid;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static bool valid_record(const CalibRecord *rec)
+{
+  /* Check that a calibration record's values are in range for every axis */
+  int axis_num;
+
+  for(axis_num = (STICKS_PER_PORT*2-1); axis_num >= 0; axis_num--) {
+    const AxisRecord *axis = (axis_num & 1) ? &rec->y[axis_num/2] : &rec->x[axis_num/2];
+    if(axis->filter < 0 || axis->filter >= NUM_FILTERS || axis->min > axis->ctr || axis->ctr > axis->max)
+      return false;
+  } /* next axis_num */
+  return true;
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1604,11 +4406,74 @@ static int eval_expr(char *buffer)
 
 /* ----------------------------------------------------------------------- */
 
-static void update_min_max(unsigned int *axis, unsigned int *jit_min, unsigned int *jit_max, int stick_num)
+static void update_min_max(unsigned int value, unsigned int *jit_min, unsigned int *jit_max)
 {
-  if(axis[stick_num] < jit_min[stick_num])
-    jit_min[stick_num] = axis[stick_num];
+  if(value < *jit_min)
+    *jit_min = value;
   
-  if(axis[stick_num] > jit_max[stick_num])
-    jit_max[stick_num] = axis[stick_num];
+  if(value > *jit_max)
+    *jit_max = value;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void robust_estimate(const unsigned int *samples, int count, unsigned int *av, unsigned int *lo, unsigned int *hi)
+{
+  /*
+     Find the mean and limits of a set of calibration values, ignoring
+     outliers (such as timings disturbed by an interrupt). A value is an
+     outlier if its distance from the median is more than ROBUST_REJECT_RANGE
+     times the root mean square distance of all the values.
+
+     Input: count values in samples (at most NUM_TEST_RUNS)
+     Outputs: av, lo and hi (if not NULL) receive the rounded mean, minimum
+              and maximum of the values kept
+  */
+  unsigned int sorted[NUM_TEST_RUNS], median, limit, total = 0, v_min = UINT_MAX, v_max = 0;
+  int i, j, kept = 0;
+
+  /* Insertion sort a copy of the values to find the median */
+  for(i = 0; i < count; i++) {
+    for(j = i; j > 0 && sorted[j-1] > samples[i]; j--)
+      sorted[j] = sorted[j-1];
+    sorted[j] = samples[i];
+  }
+  median = sorted[count/2];
+
+  /* Find the variance about the median */
+  limit = 0;
+  for(i = 0; i < count; i++) {
+    unsigned int diff;
+    absdiff(diff, samples[i], median);
+    if(diff > ROBUST_MAX_DEVIATION)
+      diff = ROBUST_MAX_DEVIATION;
+    limit += diff * diff;
+  }
+  limit = (limit / count) * (ROBUST_REJECT_RANGE * ROBUST_REJECT_RANGE);
+
+  /* Total (in fixed point) and limits of the values within range */
+  for(i = 0; i < count; i++) {
+    unsigned int diff;
+    absdiff(diff, samples[i], median);
+    if(diff > ROBUST_MIN_DEVIATION) {
+      if(diff > ROBUST_MAX_DEVIATION)
+        diff = ROBUST_MAX_DEVIATION;
+      if(diff * diff > limit)
+        continue; /* outlier */
+    }
+    total += samples[i] << ROBUST_FRAC_SHIFT;
+    update_min_max(samples[i], &v_min, &v_max);
+    kept++;
+  } /* next i */
+#ifdef DEBUG
+  xsyslogf(log_name, 50, "median %u, %d of %d values kept (%u to %u)", median, kept, count, v_min, v_max);
+#endif
+
+  /* (the median itself is always kept, so kept > 0) */
+  if(av != NULL)
+    *av = ((total / kept) + (1u << (ROBUST_FRAC_SHIFT-1))) >> ROBUST_FRAC_SHIFT;
+  if(lo != NULL)
+    *lo = v_min;
+  if(hi != NULL)
+    *hi = v_max;
 }
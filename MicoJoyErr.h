@@ -23,6 +23,6 @@
 /* RISC OS headers */
 #include "kernel.h"
 
-extern _kernel_oserror error_command_syntax, gameport_not_found, bad_joy_num, bad_reason, error_calib;
+extern _kernel_oserror error_command_syntax, gameport_not_found, bad_joy_num, bad_reason, error_calib, error_calib_busy, error_save_failed, error_bad_filter, error_too_many_clients, error_bad_client, error_escape;
 
 #endif
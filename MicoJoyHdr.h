@@ -90,6 +90,9 @@ _kernel_oserror *MicoJoy_finalise(int fatal, int podule, void *pw);
 #define CMD_JoystickCalib               1
 #define CMD_JoystickReInit              2
 #define CMD_JoystickInfo                3
+#define CMD_JoystickStats               4
+#define CMD_JoystickSave                5
+#define CMD_JoystickBench               6
 
 _kernel_oserror *MicoJoy_cmdhandler(const char *arg_string, int argc, int cmd_no, void *pw);
 
@@ -117,6 +120,13 @@ _kernel_oserror *MicoJoy_cmdhandler(const char *arg_string, int argc, int cmd_no
 #define Joystick_Read                   0x043f40
 #define Joystick_CalibrateTopRight      0x043f41
 #define Joystick_CalibrateBottomLeft    0x043f42
+#define Joystick_ReadAll                0x043f43
+#define Joystick_ReadHistory            0x043f44
+#define Joystick_ReadStats              0x043f45
+#define Joystick_CalibrationStatus      0x043f46
+#define Joystick_Register               0x043f47
+#define Joystick_Deregister             0x043f48
+#define Joystick_StateBlock             0x043f49
 #endif
 
 #define error_BAD_SWI ((_kernel_oserror *) -1)
@@ -137,6 +147,8 @@ _kernel_oserror *MicoJoy_swihandler(int swi_offset, _kernel_swi_regs *r, void *p
  * The veneer can be entered in either IRQ or SVC mode. R12 and
  * R14 are corrupted.
  */
+extern void finish_veneer(void);
+extern void timer_veneer(void);
 extern void doread_veneer(void);
 extern void stoppoll_veneer(void);
 extern void pollstick_veneer(void);
@@ -156,6 +168,8 @@ extern void pollstick_veneer(void);
  * pw is the private word pointer ('R12') value with which the
  * entry veneer is called.
  */
+_kernel_oserror *finish_handler(_kernel_swi_regs *r, void *pw);
+_kernel_oserror *timer_handler(_kernel_swi_regs *r, void *pw);
 _kernel_oserror *doread_handler(_kernel_swi_regs *r, void *pw);
 _kernel_oserror *stoppoll_handler(_kernel_swi_regs *r, void *pw);
 _kernel_oserror *pollstick_handler(_kernel_swi_regs *r, void *pw);
@@ -0,0 +1,389 @@
+/*
+ *  Joystick driver for MicroDigital Mico
+ *  Copyright (C) 2002 Chris Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef DEBUG
+/* RISC OS headers */
+#include "syslog.h"
+#endif
+
+/* ANSI library files */
+#include <ctype.h>
+
+#include "MicoJoyPrc.h"
+
+
+/*
+   No function in this file may access the gameport, IOC or any module
+   state, since it is also built into the JoyBench program
+*/
+
+#ifdef DEBUG
+static const char *log_name = "Joystick";
+#endif
+
+/* Guard against divide by zero */
+#define safedivide(quotient, dividend, divisor) { \
+  int div = divisor; \
+  if(div != 0) \
+    quotient = (dividend) / (divisor); \
+  else \
+    quotient = 0; \
+}
+
+/*
+   Constants for the adaptive filter. The new value is given a weight of
+   ADAPT_MIN_WEIGHT/256 whilst the stick is at rest, rising with its average
+   speed until it reaches 1 (at no more than ADAPT_FULL_SPEED times the
+   smoothing range per poll).
+*/
+#define ADAPT_SPEED_SHIFT  2 /* average speed moves 1/4 of the way to each change */
+#define ADAPT_MIN_WEIGHT   64
+#define ADAPT_FULL_SPEED   2
+
+static const char *const filter_names[NUM_FILTERS] = {
+  "banded", "median", "adaptive"
+};
+
+/*
+   Scale an axis timing to a signed distance from the centre dead zone
+   (shift selects the range: SCALER_FRAC_SHIFT for +/-32768). These are
+   macros so that each conversion routine gets its own copy, without the
+   centre dead zone test if it has no need of it.
+*/
+#define SCALE_CTRZONE(coeffs, time, shift) \
+  ((time) > (coeffs)->ctr_low ? \
+    ((time) < (coeffs)->ctr_high ? \
+      0 /* in centre dead zone */ : \
+      (signed int)(((coeffs)->high_scaler * ((time) - (coeffs)->ctr_high)) >> (shift))) : \
+    - (signed int)(((coeffs)->low_scaler * ((coeffs)->ctr_low - (time))) >> (shift)))
+
+#define SCALE_NOCTRZONE(coeffs, time, shift) \
+  ((time) > (coeffs)->ctr_high ? \
+    (signed int)(((coeffs)->high_scaler * ((time) - (coeffs)->ctr_high)) >> (shift)) : \
+    - (signed int)(((coeffs)->low_scaler * ((coeffs)->ctr_low - (time))) >> (shift)))
+
+/*
+   Template for a pair of conversion routines (8-bit and 16-bit) that use
+   the given scaling macro
+*/
+#define CONVERSION_ROUTINES(convert_8bit_name, convert_16bit_name, scale) \
+\
+unsigned int convert_8bit_name(const AxisCoeffs *x_coeffs, const AxisCoeffs *y_coeffs, unsigned int x_time, unsigned int y_time) \
+{ \
+  /* \
+     Convert axis timings to signed 8-bit joystick position \
+     (as returned in bits 0-15 of R0 by Joystick_Read 0) \
+  */ \
+  signed int x, y; \
+\
+  /* calc joystick 8-bit position */ \
+  x = scale(x_coeffs, x_time, SCALER_FRAC_SHIFT+8); \
+  /* Make absolutely sure value within range */ \
+  if(x < -127) \
+    x = -127; \
+  else { \
+    if(x > 127) \
+      x = 127; \
+  } \
+\
+  y = -scale(y_coeffs, y_time, SCALER_FRAC_SHIFT+8); /* y axis timings are inverted */ \
+  /* Make absolutely sure value within range */ \
+  if(y < -127) \
+    y = -127; \
+  else { \
+    if(y > 127) \
+      y = 127; \
+  } \
+\
+  return (y & 0xff) | ((x & 0xff)<<8); \
+} \
+\
+unsigned int convert_16bit_name(const AxisCoeffs *x_coeffs, const AxisCoeffs *y_coeffs, unsigned int x_time, unsigned int y_time) \
+{ \
+  /* \
+     Convert axis timings to unsigned 16-bit joystick position \
+     (as returned in R0 by Joystick_Read 1) \
+  */ \
+  signed int x, y; \
+\
+  /* calc joystick 16-bit position */ \
+  x = 0x7fff + scale(x_coeffs, x_time, SCALER_FRAC_SHIFT); \
+  /* Make absolutely sure value within range */ \
+  if(x < 0) \
+    x = 0; \
+  else { \
+    if(x > 0xffff) \
+      x = 0xffff; \
+  } \
+\
+  y = 0x7fff - scale(y_coeffs, y_time, SCALER_FRAC_SHIFT); /* y axis timings are inverted */ \
+  /* Make absolutely sure value within range */ \
+  if(y < 0) \
+    y = 0; \
+  else { \
+    if(y > 0xffff) \
+      y = 0xffff; \
+  } \
+\
+  return (y & 0xffff) | (x << 16); \
+}
+
+static unsigned int median_value(FilterState *state, unsigned int new_value);
+static unsigned int adaptive_value(FilterState *state, unsigned int prev_value, unsigned int new_value, unsigned int stddev);
+
+/* ----------------------------------------------------------------------- */
+/*                         Public functions                                */
+
+int find_filter(const char *name)
+{
+  /*
+     Look up a filter by name (case insensitive)
+     Returns: filter number, or -1 if not recognised
+  */
+  int filter;
+  for(filter = 0; filter < NUM_FILTERS; filter++) {
+    const char *a = name, *b = filter_names[filter];
+    while(*a != '\0' && tolower((unsigned char)*a) == *b) {
+      a++;
+      b++;
+    }
+    if(*a == '\0' && *b == '\0')
+      return filter; /* success */
+  }
+  return -1; /* fail */
+}
+
+/* ----------------------------------------------------------------------- */
+
+const char *filter_name(int filter)
+{
+  if(filter < 0 || filter >= NUM_FILTERS)
+    return "?";
+  return filter_names[filter];
+}
+
+/* ----------------------------------------------------------------------- */
+
+void reset_filter(FilterState *state, unsigned int value)
+{
+  /*
+     Forget the history of an axis (e.g. after calibration), as if it had
+     been at rest at the given timing
+  */
+  state->older = value;
+  state->old = value;
+  state->speed = 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+unsigned int filter_value(int filter, FilterState *state, unsigned int prev_value, unsigned int new_value, unsigned int stddev)
+{
+  /*
+     Pass a new axis timing through the selected filter, given the previous
+     output and the axis' smoothing range
+  */
+  switch(filter) {
+    case FILTER_MEDIAN:
+      return median_value(state, new_value);
+
+    case FILTER_ADAPTIVE:
+      return adaptive_value(state, prev_value, new_value, stddev);
+
+    default:
+      return smooth_value(prev_value, new_value, stddev);
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+unsigned int smooth_value(unsigned int prev_value, unsigned int new_value, unsigned int stddev)
+{
+  if((new_value >= (prev_value - stddev)) && (new_value <= (prev_value + stddev))) {
+  /* very likely to be jitter - smooth it lots */
+#ifdef DEBUG
+    xsyslogf(log_name, 50, "much smoothing of value %u", new_value);
+#endif /* DEBUG */
+    return ((prev_value * 3) + new_value) / 4;
+  }
+
+  if((new_value >= (prev_value - (stddev*2))) && (new_value <= (prev_value + (stddev*2)))) {
+    /* near average jitter - smooth it rather less */
+#ifdef DEBUG
+    xsyslogf(log_name, 50, "moderate smoothing of value %u", new_value);
+#endif /* DEBUG */
+    return (prev_value + new_value) / 2;
+  }
+
+  if((new_value >= (prev_value - (stddev*4))) && (new_value <= (prev_value + (stddev*4)))) {
+    /* even further away from average jitter - smooth it slightly */
+#ifdef DEBUG
+    xsyslogf(log_name, 50, "slight smoothing of value %u", new_value);
+#endif /* DEBUG */
+    return ((new_value * 3) + prev_value) / 4;
+
+  } else {
+    /* miles from jitter bounds - use new value verbatim */
+#ifdef DEBUG
+    xsyslogf(log_name, 50, "taking new value %u verbatim", new_value);
+#endif /* DEBUG */
+    return new_value;
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+void calc_coefficients(AxisCoeffs *coeffs, unsigned int min, unsigned int ctr, unsigned int max, unsigned int ctr_deadz, unsigned int end_deadz)
+{
+  /*
+     Calculate correction coefficients for one axis from its calibration
+     data (pass 0 for either dead zone if it is disabled)
+  */
+  coeffs->ctr_low = ctr - ctr_deadz;
+  coeffs->ctr_high = ctr + ctr_deadz;
+
+  safedivide(coeffs->low_scaler, (32768<<SCALER_FRAC_SHIFT), coeffs->ctr_low - (min + end_deadz));
+  safedivide(coeffs->high_scaler, (32768<<SCALER_FRAC_SHIFT), (max - end_deadz) - coeffs->ctr_high);
+
+#ifdef DEBUG
+  xsyslogf(log_name, 50, "centre limits %u,%u, scalers %u/16384,%u/16384", coeffs->ctr_low, coeffs->ctr_high, coeffs->low_scaler, coeffs->high_scaler);
+#endif
+}
+
+/* ----------------------------------------------------------------------- */
+
+int select_conversion(const AxisCoeffs *x_coeffs, const AxisCoeffs *y_coeffs)
+{
+  /*
+     Choose the conversion routines for a joystick from its correction
+     coefficients (call again whenever they are recalculated). This covers
+     -noctrzone and axes calibrated without a centre dead zone alike; the
+     end zone and smoothing settings don't affect the routines needed.
+  */
+  if(x_coeffs->ctr_low == x_coeffs->ctr_high && y_coeffs->ctr_low == y_coeffs->ctr_high)
+    return CONVERT_NOCTRZONE; /* no centre dead zone to test for */
+
+  return CONVERT_CTRZONE;
+}
+
+/* ----------------------------------------------------------------------- */
+
+/* General case (convert_8bit, convert_16bit) */
+CONVERSION_ROUTINES(convert_8bit, convert_16bit, SCALE_CTRZONE)
+
+/* ----------------------------------------------------------------------- */
+
+/* Neither axis has a centre dead zone (convert_8bit_noctrzone, convert_16bit_noctrzone) */
+CONVERSION_ROUTINES(convert_8bit_noctrzone, convert_16bit_noctrzone, SCALE_NOCTRZONE)
+
+/* ----------------------------------------------------------------------- */
+
+signed int convert_fixed(const AxisCoeffs *coeffs, unsigned int time)
+{
+  /*
+     Convert an axis timing to a signed fixed point position in the range
+     -1 to +1, with POSITION_FRAC_SHIFT bits of fraction
+     (as returned by Joystick_Read 5, but not inverted for the y axis)
+  */
+  signed int pos;
+
+  /* calc position (+/-32768 at SCALER_FRAC_SHIFT, so 15 bits fewer of shift than fraction wanted) */
+  pos = SCALE_CTRZONE(coeffs, time, SCALER_FRAC_SHIFT + 15 - POSITION_FRAC_SHIFT);
+  /* Make absolutely sure value within range */
+  if(pos < -(1<<POSITION_FRAC_SHIFT))
+    pos = -(1<<POSITION_FRAC_SHIFT);
+  else {
+    if(pos > (1<<POSITION_FRAC_SHIFT))
+      pos = (1<<POSITION_FRAC_SHIFT);
+  }
+
+  return pos;
+}
+
+/* ----------------------------------------------------------------------- */
+/*                         Private functions                               */
+
+static unsigned int median_value(FilterState *state, unsigned int new_value)
+{
+  /*
+     Output the median of the last three timings, so that a single anomalous
+     value is discarded (at the expense of one poll's delay in following a
+     step change)
+  */
+  unsigned int a = state->older, b = state->old, median;
+
+  state->older = b;
+  state->old = new_value;
+
+  if(a > b) {
+    unsigned int swap = a;
+    a = b;
+    b = swap;
+  }
+  /* now a <= b */
+  if(new_value <= a)
+    median = a;
+  else {
+    if(new_value >= b)
+      median = b;
+    else
+      median = new_value;
+  }
+#ifdef DEBUG
+  if(median != new_value)
+    xsyslogf(log_name, 50, "median filter replaced value %u with %u", new_value, median);
+#endif /* DEBUG */
+  return median;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int adaptive_value(FilterState *state, unsigned int prev_value, unsigned int new_value, unsigned int stddev)
+{
+  /*
+     Low-pass filter whose cut-off frequency rises with the speed of
+     movement (after the 'One Euro' filter), so that jitter is smoothed
+     heavily at rest but a moving stick is followed with little lag
+  */
+  signed int change = (signed int)new_value - (signed int)prev_value;
+  unsigned int speed, weight, step;
+
+  if(stddev == 0)
+    return new_value; /* no jitter to smooth */
+
+  /* Track the average speed of movement */
+  state->speed += ((change * (1<<FILTER_SPEED_SHIFT)) - state->speed) / (1<<ADAPT_SPEED_SHIFT);
+  speed = state->speed < 0 ? -state->speed : state->speed;
+
+  /* Weight (out of 256) to give the new value */
+  weight = ADAPT_MIN_WEIGHT + (speed << (8 - FILTER_SPEED_SHIFT)) / (stddev * ADAPT_FULL_SPEED);
+  if(weight > 256)
+    weight = 256;
+#ifdef DEBUG
+  xsyslogf(log_name, 50, "adaptive filter weight %u/256 for value %u", weight, new_value);
+#endif /* DEBUG */
+
+  if(change < 0) {
+    step = ((unsigned int)-change * weight) >> 8;
+    return prev_value - step;
+  } else {
+    step = ((unsigned int)change * weight) >> 8;
+    return prev_value + step;
+  }
+}
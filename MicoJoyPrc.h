@@ -0,0 +1,90 @@
+/*
+ *  Joystick driver for MicroDigital Mico
+ *  Copyright (C) 2002 Chris Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __MicoJoyPrc_h
+#define __MicoJoyPrc_h
+
+/*
+   Processing of axis timings that does not touch the hardware, so that the
+   same code can be built into the module and into the JoyBench program
+*/
+
+#define SCALER_FRAC_SHIFT 14
+
+#define POSITION_FRAC_SHIFT 24 /* fractional bits of positions from convert_fixed */
+
+/*
+   Unpack a 16-bit position from convert_16bit. Each axis is unsigned,
+   0 to 0xffff with the centre at 0x7fff.
+*/
+#define POS16_X(pos) ((pos) >> 16)
+#define POS16_Y(pos) ((pos) & 0xffff)
+
+/*
+   Values used in *actual* conversion to 8-bit / 16-bit position
+   (derived from an axis' calibration values by calc_coefficients)
+*/
+typedef struct {
+  unsigned int ctr_low, ctr_high; /* limits of centre dead zone */
+  unsigned int low_scaler, high_scaler; /* fixed point, SCALER_FRAC_SHIFT bits of fraction */
+} AxisCoeffs;
+
+/*
+   Conversion routines that may be used for a pair of axes (as chosen by
+   select_conversion). Only the centre dead zone needs a variant: end zones
+   are folded into the scalers by calc_coefficients, so they cost nothing
+   when converting, and smoothing is done before conversion (see
+   filter_value), so the routines never test for it.
+*/
+#define CONVERT_CTRZONE   0 /* general case: convert_8bit, convert_16bit */
+#define CONVERT_NOCTRZONE 1 /* no centre dead zone: convert_8bit_noctrzone, convert_16bit_noctrzone */
+
+/*
+   Smoothing filters that may be selected for each axis
+   (*JoystickCalib -filter)
+*/
+#define FILTER_BANDED   0 /* weight given to new value depends on distance from old */
+#define FILTER_MEDIAN   1 /* median of the last 3 timings (rejects single spikes) */
+#define FILTER_ADAPTIVE 2 /* weight given to new value depends on speed of movement */
+#define NUM_FILTERS     3
+
+#define FILTER_SPEED_SHIFT 4
+
+/*
+   History needed by a filter, kept for each axis
+*/
+typedef struct {
+  unsigned int older, old; /* previous two timings (FILTER_MEDIAN) */
+  signed int speed; /* average change per poll, FILTER_SPEED_SHIFT bits of fraction (FILTER_ADAPTIVE) */
+} FilterState;
+
+extern int find_filter(const char *name);
+extern const char *filter_name(int filter);
+extern void reset_filter(FilterState *state, unsigned int value);
+extern unsigned int filter_value(int filter, FilterState *state, unsigned int prev_value, unsigned int new_value, unsigned int stddev);
+extern unsigned int smooth_value(unsigned int prev_value, unsigned int new_value, unsigned int stddev);
+extern void calc_coefficients(AxisCoeffs *coeffs, unsigned int min, unsigned int ctr, unsigned int max, unsigned int ctr_deadz, unsigned int end_deadz);
+extern unsigned int convert_8bit(const AxisCoeffs *x_coeffs, const AxisCoeffs *y_coeffs, unsigned int x_time, unsigned int y_time);
+extern unsigned int convert_16bit(const AxisCoeffs *x_coeffs, const AxisCoeffs *y_coeffs, unsigned int x_time, unsigned int y_time);
+extern int select_conversion(const AxisCoeffs *x_coeffs, const AxisCoeffs *y_coeffs);
+extern unsigned int convert_8bit_noctrzone(const AxisCoeffs *x_coeffs, const AxisCoeffs *y_coeffs, unsigned int x_time, unsigned int y_time);
+extern unsigned int convert_16bit_noctrzone(const AxisCoeffs *x_coeffs, const AxisCoeffs *y_coeffs, unsigned int x_time, unsigned int y_time);
+extern signed int convert_fixed(const AxisCoeffs *coeffs, unsigned int time);
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ *  Joystick driver for MicroDigital Mico
+ *  Copyright (C) 2002 Chris Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __MicoJoySmp_h
+#define __MicoJoySmp_h
+
+/*
+   Parameters for sample_axes() - layout must match sampler.a
+   Axis bits for the second gameport follow those of the first, shifted
+   by 4 bits.
+*/
+#define SAMPLE_PORTS 2 /* gameports sampled together */
+
+typedef struct {
+  volatile unsigned char *port[SAMPLE_PORTS]; /* gameport addresses (NULL if none) */
+  unsigned int mask; /* axes to read (on exit, axes that timed out) */
+  unsigned int start_time; /* timer 0 value when axis bits were set (on exit, adjusted for wrap) */
+  unsigned int max_wait; /* give up after this many ticks */
+  unsigned int tolerance; /* maximum interval between samples */
+  unsigned int lost; /* on exit, axes lost because an interval exceeded tolerance */
+  unsigned int times[SAMPLE_PORTS * 4]; /* on exit, timings for axes in bit order (unaltered if not read) */
+} SampleBlock;
+
+extern void sample_axes(SampleBlock *block);
+
+#endif